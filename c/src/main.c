@@ -15,23 +15,59 @@
 #define _GNU_SOURCE // for Linux
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __APPLE__
+#define st_mtim st_mtimespec // macOS names the nanosecond timestamps of struct stat differently
+#define st_ctim st_ctimespec
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h> // SSE2 intrinsics, used to find newlines 16 bytes at a time
+#endif
+
 /*** defines ***/
 
 #define TINY_VERSION "0.0.1"
 #define TAB_STOP 8
 #define QUIT_TIMES 2
+#define ROW_NODE_MAX 64 // max rows in a leaf / children in an inner node of the row tree
+#define ROW_GAP_MIN 16 // smallest capacity of a row's gap buffer
+#define LOAD_THREADS_MAX 16 // max threads splitting up a file on open
+#define LOAD_CHUNK_MIN (1 << 20) // smallest part of a file worth handing to another thread
+#define SAVE_IOV_MAX 1024 // iovecs per writev() call (IOV_MAX on Linux)
+#define SAVE_BACKGROUND_MIN (8 << 20) // buffers at least this big are saved on a background thread
+#define FRAME_GAP_MAX 8 // unchanged cells worth sending to avoid a cursor move (about what "\x1b[y;xH" costs)
+#define ATTR_PLAIN 39 // cell attributes: the default foreground color,
+#define ATTR_INVERSE 0x80 // and reverse video
+#define FRAME_RATE_MAX 60 // frames per second at most while keys keep coming in
+#define INPUT_BUF_SIZE 4096 // bytes of input buffered, and read() at once at most. a power of 2: E.inbuf is a ring
+#define INPUT_TIMEOUT_MS 100 // how long to wait for the rest of an escape sequence or paste
+#define STATUS_MSG_MILLIS 5000 // how long a status message stays up
+#define SYNTAX_DIR_ENV "TINY_SYNTAX_DIR" // directory of syntax definition files, if set in the environment;
+#define SYNTAX_DIR_HOME ".tiny/syntax" // otherwise this one under $HOME
+#define SYNTAX_KEYWORDS_MAX 1024 // keywords (and types) a definition file may have at most,
+#define SYNTAX_KEYWORD_LEN_MAX 32 // and bytes in each: together they keep the keyword trie within KEYWORD_TRIE_NODES_MAX
+#define KEYWORD_TRIE_NODES_MAX 65535 // nodes a keyword trie can number, with node ids in an unsigned short
+#define HL_SYNC_ROWS 1024 // rows a frame may catch up on highlighting by itself, before leaving it to the worker thread
+#define HL_JOB_ROWS 4096 // rows the highlighting worker thread does at a time: copied on the main thread, so kept short
 
 #define CTRL_KEY(k) ((k) & 0x1f) // bitwise-AND k with 00011111
 
@@ -45,7 +81,8 @@ enum editorKey {
     HOME_KEY,
     END_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    PASTE_START // "\x1b[200~": what follows was pasted (see editorReadPaste())
 };
 
 enum editorHighlight {
@@ -59,11 +96,47 @@ enum editorHighlight {
     HL_MATCH
 };
 
+enum editorWakeup { // what wrote to E.wakefd (see editorWake())
+    WAKE_RESIZE = 'r', // SIGWINCH: the terminal changed size
+    WAKE_SAVE = 's', // a background save finished
+    WAKE_HIGHLIGHT = 'h' // a highlight job finished
+};
+
 #define HL_HIGHLIGHT_NUMBERS (1<<0) // 00000001
 #define HL_HIGHLIGHT_STRINGS (1<<1) // 00000010
 
+#define CC_SEPARATOR (1<<0) // character classes (see editorSyntaxCompile()): ends a word
+#define CC_DIGIT (1<<1) // is part of a number
+#define CC_QUOTE (1<<2) // starts a string
+#define CC_COMMENT (1<<3) // may start a comment delimiter
+
 /*** data ***/
 
+/**
+ * `keywordTrie`
+ * The keywords of a syntax compiled into a trie, so that the highlighter finds the keyword a token is (if any)
+ * in one walk over the token, instead of comparing it with every keyword in turn.
+ * Bytes that occur in no keyword all share class 0, which leads nowhere,
+ * so a node only needs a slot for each byte that does occur.
+*/
+struct keywordTrie {
+    unsigned char cls[256]; // class of each byte: 1 to nclasses - 1 if some keyword has it, 0 otherwise
+    int nclasses;
+    unsigned short *next; // next[node * nclasses + class]: the child of node, 0 for none (node 0 is the root, no one's child)
+    unsigned char *match; // match[node]: HL_KEYWORD1 or HL_KEYWORD2 if a keyword ends at node, HL_NORMAL if none does
+};
+
+/**
+ * `hlspan`
+ * A run of highlighted text in a row. Rows keep only these, not a highlight per character:
+ * text between the spans is HL_NORMAL, as most text is.
+*/
+struct hlspan {
+    int start; // render column the run starts at
+    int len;
+    unsigned char hl; // HL_* of the run
+};
+
 struct editorSyntax {
     char *filetype; // file extension
     char **filematch; // filename
@@ -72,18 +145,54 @@ struct editorSyntax {
     char *multiline_comment_start; // multi line comment start
     char *multiline_comment_end; // multi line comment end
     int flags; // flags
+    char *separators; // characters besides whitespace that end a word
+    unsigned char cclass[256]; // CC_* classes of each character, worked out by editorSyntaxCompile()
+    struct keywordTrie *kwtrie; // keywords, compiled by editorSyntaxCompile() when the syntax is first selected
 };
 
 typedef struct erow {
-    int idx; // index
+    struct rownode *leaf; // leaf of the row tree that holds this row
     int size;
     int rsize; // render size
-    char *chars;
+    char *chars; // gap buffer: chars[0, gap) and chars[gap + gaplen, size + gaplen) are the text
+    int gap; // start of the gap
+    int gaplen; // length of the gap
+    int owned; // 1 if chars is our own gap buffer, 0 if it still points into the original file buffer
     char *render; // render string
-    unsigned char *hl; // highlight
+    struct hlspan *hl; // highlight: runs of text that isn't HL_NORMAL, in order
+    int nhl; // number of spans in hl
     int hl_open_comment; // highlight open comment
 } erow;
 
+/**
+ * `cell`
+ * One character position of the screen: what it shows, and how.
+*/
+typedef struct {
+    char c;
+    unsigned char attr; // foreground color (30-37, ATTR_PLAIN for the default) | ATTR_INVERSE
+} cell;
+
+/**
+ * `rownode`
+ * A node of the counted B-tree that stores the rows.
+ * Leaves hold up to ROW_NODE_MAX erows inline, inner nodes hold up to ROW_NODE_MAX children.
+ * Every node knows how many rows are below it,
+ * so looking up, inserting and deleting a row by line number only walks one root-to-leaf path: O(log n).
+*/
+typedef struct rownode {
+    struct rownode *parent;
+    int leaf; // 1 if this node holds rows, 0 if it holds child nodes
+    int n; // number of rows (leaf) or children (inner node) in this node
+    int count; // number of rows in this subtree
+    erow *rows; // rows of a leaf
+    struct rownode **child; // children of an inner node
+    struct rownode *prev, *next; // neighbouring leaves, so walking rows in order stays O(1) per row
+    int rendered; // leaf only: 1 if some of its rows may be materialized (see editorEvictRows()),
+    struct rownode *rprev, *rnext; // and its neighbours in the list of such leaves, E.renderedleaves
+    int edited; // leaf only: 0 while its rows are unedited lines, back to back in E.orig with a '\n' after each
+} rownode;
+
 struct editorConfig {
     int cx, cy; // cursor x, y position
     int rx; // render x position
@@ -92,12 +201,37 @@ struct editorConfig {
     int screenrows;
     int screencols;
     int numrows; // number of rows
-    erow *row; // pointer to array of erow structs. Dynamically allocated array of erow structs.
+    rownode *rowroot; // root of the row tree
+    char *orig; // original file buffer; unedited rows point into it. bytes a row still borrows are never overwritten
+    size_t origlen; // length of the original file buffer
+    int origmapped; // 1 if orig is an mmap() of the file (which editorSaveInPlace() may write to), 0 if it is a malloc'd copy
+    size_t origmaplen; // bytes mapped (or allocated) at orig
+    dev_t origdev; // device and inode of the file orig was loaded from,
+    ino_t origino; // to tell whether it is still the one on disk
+    int origfd; // the file orig maps, kept open to notice another program changing it (see editorOrigCheck()), or -1
+    struct stat origstat; // and what fstat() said of it when we last loaded or wrote it
+    int nrendered; // number of rows whose render and hl are materialized
+    rownode *renderedleaves; // leaves whose rendered flag is set, linked through rprev and rnext
+    int hlfrontier; // rows before it end in the multi line comment state hl_open_comment says. E.numrows when all do
+    int hlpending; // rows before it must be re-highlighted to catch up; after it, a row whose state stays the same ends it
+    struct highlightJob *hljob; // highlight job running in the background, or NULL
+    struct saveJob *save; // save running in the background, or NULL
+    cell *frame; // frame being drawn: framerows lines of framecols cells
+    cell *shown; // frame the terminal shows, or NULL if we don't know
+    int shownrowoff; // E.rowoff of the frame the terminal shows
+    int framerows, framecols;
+    char inbuf[INPUT_BUF_SIZE]; // input read but not yet taken, from inhead up to intail
+    unsigned int inhead, intail; // count up for ever; their difference is what is buffered
+    int wakefd[2]; // pipe that signal handlers and worker threads write to, to wake editorWaitEvents()
     int dirty; // dirty flag
     char *filename; // filename
     char statusmsg[80]; // status message
-    time_t statusmsg_time; // status message time
+    long long statusmsg_time; // when the status message was set (monotonicMillis()), or -1 while a prompt holds it
     struct editorSyntax *syntax; // pointer to editorSyntax struct
+    int matchrow; // row with a find match to show as HL_MATCH over its own highlight, or -1
+    int matchcol, matchlen; // render columns of the match
+    struct editorSyntax *syntaxes; // syntaxes loaded from definition files (see editorLoadSyntaxes()), tried before HLDB
+    int nsyntaxes;
     struct termios orig_termios;
 };
 
@@ -122,7 +256,10 @@ struct editorSyntax HLDB[] = {
         "//", // single line comment start
         "/*", // multi line comment start
         "*/", // multi line comment end
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+        ",.()+-/*=~%<>[];", // separators
+        { 0 }, // character classes
+        NULL // compiled keywords
     },
 };
 
@@ -131,7 +268,17 @@ struct editorSyntax HLDB[] = {
 /*** prototypes ***/
 
 void editorSetStatusMessage(const char *fmt, ...);
+char *editorRenderText(erow *row, char *buf, int *rsize);
+size_t editorRowCopy(erow *row, char *buf);
 void editorRefreshScreen();
+int getWindowSize(int *rows, int *cols);
+int editorSavePoll();
+void editorSyntaxCatchUp(int until);
+int editorHighlightFinish();
+void editorHighlightJobEdit(int at, int delta);
+void editorSaveWait();
+int editorOrigCheck();
+void editorOrigFree();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
 
 /*** terminal ***/
@@ -144,6 +291,7 @@ void die(const char *s) {
 }
 
 void disableRawMode() {
+    write(STDOUT_FILENO, "\x1b[?2004l", 8); // bracketed paste off
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1) die("tcsetattr");
 }
 
@@ -237,9 +385,164 @@ void enableRawMode() {
     raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG); // disable echoing of input
 
     raw.c_cc[VMIN] = 0; // minimum number of bytes of input needed before read() can return
-    raw.c_cc[VTIME] = 1; // maximum amount of time to wait before read() returns
+    raw.c_cc[VTIME] = 0; // maximum amount of time to wait before read() returns. none: editorInputFill() waits in poll() instead
 
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr"); // set terminal attributes
+    write(STDOUT_FILENO, "\x1b[?2004h", 8); // bracketed paste on: pastes come as one PASTE_START key (see editorReadPaste())
+}
+
+/**
+ * `editorInputFill()`
+ * waits up to timeout ms (-1: for as long as it takes) for input, then reads what there is into E.inbuf with one read().
+ * returns the number of bytes read, 0 if none came in time.
+*/
+int editorInputFill(int timeout) {
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    unsigned int at = E.intail % INPUT_BUF_SIZE;
+    size_t room = INPUT_BUF_SIZE - (E.intail - E.inhead);
+    ssize_t nread;
+    int ready;
+
+    if (room > INPUT_BUF_SIZE - at) room = INPUT_BUF_SIZE - at; // the free space wraps around at the end of the ring
+    if (room == 0) return 0;
+
+    ready = poll(&pfd, 1, timeout);
+    if (ready == -1 && errno != EINTR) die("poll");
+    if (ready <= 0) return 0;
+
+    nread = read(STDIN_FILENO, &E.inbuf[at], room);
+    if (nread == -1) {
+        if (errno == EAGAIN || errno == EINTR) return 0;
+        die("read");
+    }
+    if (nread == 0 && (pfd.revents & (POLLHUP | POLLERR))) die("read"); // the terminal went away
+    E.intail += nread;
+    return nread;
+}
+
+/**
+ * `editorInputByte()`
+ * takes the next byte of input into *c, waiting up to timeout ms for one if none is buffered.
+ * returns 1 if there was one, 0 if not.
+*/
+int editorInputByte(char *c, int timeout) {
+    if (E.inhead == E.intail && editorInputFill(timeout) == 0) return 0;
+    *c = E.inbuf[E.inhead++ % INPUT_BUF_SIZE];
+    return 1;
+}
+
+/**
+ * `editorInputPending()`
+ * returns 1 if there are keys waiting to be read, without waiting for any.
+*/
+int editorInputPending() {
+    return E.inhead != E.intail || editorInputFill(0) > 0; // a timeout of 0 returns at once
+}
+
+long long monotonicMillis() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * `editorWake()`
+ * wakes editorWaitEvents() up to handle why. Safe to call from signal handlers and other threads.
+*/
+void editorWake(char why) {
+    int saved = errno; // a signal handler must leave errno as it found it
+    write(E.wakefd[1], &why, 1); // if the pipe is full, editorWaitEvents() has wakeups waiting already
+    errno = saved;
+}
+
+void handleSigWinch(int sig) {
+    (void)sig;
+    editorWake(WAKE_RESIZE);
+}
+
+/**
+ * `editorInitEvents()`
+ * sets up what editorWaitEvents() waits on besides keys: the wakeup pipe, and SIGWINCH to write to it.
+*/
+void editorInitEvents() {
+    struct sigaction sa;
+
+    if (pipe(E.wakefd) == -1) die("pipe");
+    for (int i = 0; i < 2; i++) {
+        fcntl(E.wakefd[i], F_SETFL, O_NONBLOCK);
+        fcntl(E.wakefd[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handleSigWinch;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART; // let a blocking write() to the terminal carry on; poll() returns EINTR either way
+    if (sigaction(SIGWINCH, &sa, NULL) == -1) die("sigaction");
+}
+
+/**
+ * `editorResize()`
+ * picks up the new size of the terminal. The next refresh redraws all of it.
+*/
+void editorResize() {
+    int rows, cols;
+    if (getWindowSize(&rows, &cols) == -1) return; // keep the old size
+    E.screenrows = rows - 2; // make room for status bar and message bar
+    E.screencols = cols;
+    free(E.shown); // the terminal may have moved or dropped what it showed
+    E.shown = NULL;
+}
+
+/**
+ * `editorWaitEvents()`
+ * sleeps until a key comes in, handling whatever else happens in the meantime:
+ * a resize, a background save or highlight job finishing, the status message timing out.
+ * These redraw the screen by themselves, as no keypress will come along to do it.
+*/
+void editorWaitEvents() {
+    struct pollfd pfd[2] = {
+        { STDIN_FILENO, POLLIN, 0 },
+        { E.wakefd[0], POLLIN, 0 }
+    };
+    int timeout = -1;
+    int redraw = 0;
+
+    if (E.statusmsg[0] && E.statusmsg_time != -1) { // wake up when the status message is due to go
+        long long left = E.statusmsg_time + STATUS_MSG_MILLIS - monotonicMillis();
+        timeout = left > 0 ? left : 0;
+    }
+
+    if (poll(pfd, 2, timeout) == -1) {
+        if (errno != EINTR) die("poll");
+        return;
+    }
+    if (editorOrigCheck()) redraw = 1; // before any row is touched
+
+    if (pfd[1].revents & POLLIN) {
+        char why[64];
+        ssize_t n = read(E.wakefd[0], why, sizeof(why));
+        for (ssize_t i = 0; i < n; i++) {
+            switch (why[i]) {
+                case WAKE_RESIZE:
+                    editorResize();
+                    redraw = 1;
+                    break;
+                case WAKE_SAVE:
+                    if (editorSavePoll()) redraw = 1; // show how it went
+                    break;
+                case WAKE_HIGHLIGHT:
+                    if (editorHighlightFinish()) redraw = 1; // swap in the colors
+                    break;
+            }
+        }
+    }
+
+    if (E.statusmsg[0] && E.statusmsg_time != -1 && monotonicMillis() - E.statusmsg_time >= STATUS_MSG_MILLIS) {
+        E.statusmsg[0] = '\0'; // gone for good: no need to wake up for it again
+        redraw = 1;
+    }
+
+    if (redraw) editorRefreshScreen();
 }
 
 /**
@@ -247,26 +550,18 @@ void enableRawMode() {
  * waits for one keypress and returns it.
 */
 int editorReadKey() {
-    int nread;
     char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) { // read 1 byte from stdin into c
-        /**
-         * read() returns the number of bytes read, or -1 on error, in which case errno is set appropriately. 
-         * Cygwin returns -1 when there is no input available, so we have to check errno to make sure it’s not actually an error.
-        */
-        if (nread == -1 && errno != EAGAIN) die("read");
-    }
+    while (!editorInputByte(&c, 0)) editorWaitEvents(); // nothing typed yet: sleep until something happens
 
     if (c == '\x1b') {
         char seq[3];
 
         /**
-         * `read()`
-         * read() attempts to read up to count bytes from file descriptor fd into the buffer starting at buf.
-         * if return value is not 1, then we know it’s not an escape sequence, so we return the character as-is.
+         * `editorInputByte()`
+         * if nothing follows the escape within INPUT_TIMEOUT_MS, then we know it’s not an escape sequence, so we return the character as-is.
         */
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b'; // read 1 byte from stdin into seq[0]
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b'; // read 1 byte from stdin into seq[1]
+        if (!editorInputByte(&seq[0], INPUT_TIMEOUT_MS)) return '\x1b'; // take 1 byte of input into seq[0]
+        if (!editorInputByte(&seq[1], INPUT_TIMEOUT_MS)) return '\x1b'; // take 1 byte of input into seq[1]
 
         /**
          * The Home key could be sent as <esc>[1~, <esc>[7~, <esc>[H, or <esc>OH.
@@ -274,16 +569,21 @@ int editorReadKey() {
         */
         if (seq[0] == '[') {
             if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b'; // read 1 byte from stdin into seq[2]
+                int n = seq[1] - '0'; // <esc>[n~, where n may have more than one digit
+                do {
+                    if (!editorInputByte(&seq[2], INPUT_TIMEOUT_MS)) return '\x1b'; // take 1 byte of input into seq[2]
+                    if (seq[2] >= '0' && seq[2] <= '9') n = n * 10 + seq[2] - '0';
+                } while (seq[2] >= '0' && seq[2] <= '9');
                 if (seq[2] == '~') {
-                    switch (seq[1]) {
-                        case '1': return HOME_KEY; // home
-                        case '3': return DEL_KEY; // delete
-                        case '4': return END_KEY; // end
-                        case '5': return PAGE_UP; // page up
-                        case '6': return PAGE_DOWN; // page down
-                        case '7': return HOME_KEY; // home
-                        case '8': return END_KEY; // end
+                    switch (n) {
+                        case 1: return HOME_KEY; // home
+                        case 3: return DEL_KEY; // delete
+                        case 4: return END_KEY; // end
+                        case 5: return PAGE_UP; // page up
+                        case 6: return PAGE_DOWN; // page down
+                        case 7: return HOME_KEY; // home
+                        case 8: return END_KEY; // end
+                        case 200: return PASTE_START; // bracketed paste
                     }
                 }
             } else {
@@ -309,6 +609,43 @@ int editorReadKey() {
     }
 }
 
+/**
+ * `editorReadPaste()`
+ * reads pasted text, up to the "\x1b[201~" that ends it, into a malloc'd buffer and returns it.
+ * The terminal only brackets pastes like this after "\x1b[?2004h" (see enableRawMode()).
+*/
+char *editorReadPaste(size_t *len) {
+    size_t cap = 4096;
+    size_t n = 0;
+    char *buf = malloc(cap);
+
+    // if the input goes quiet before the end marker comes, that is the end of it
+    while (E.inhead != E.intail || editorInputFill(INPUT_TIMEOUT_MS) > 0) {
+        unsigned int at = E.inhead % INPUT_BUF_SIZE;
+        size_t run = E.intail - E.inhead;
+        size_t from = n < 5 ? 0 : n - 5; // the marker may have begun in the last run
+        char *end;
+
+        if (run > INPUT_BUF_SIZE - at) run = INPUT_BUF_SIZE - at; // up to where the ring wraps
+        if (n + run > cap) {
+            while (n + run > cap) cap *= 2;
+            buf = realloc(buf, cap);
+        }
+        memcpy(&buf[n], &E.inbuf[at], run);
+
+        end = memmem(&buf[from], n + run - from, "\x1b[201~", 6);
+        if (end) { // end of the paste. what comes after it is left for editorReadKey()
+            E.inhead += end + 6 - &buf[n];
+            n = end - buf;
+            break;
+        }
+        E.inhead += run;
+        n += run;
+    }
+    *len = n;
+    return buf;
+}
+
 int getCursorPosition(int *rows, int *cols) {
     char buf[32];
     unsigned int i = 0;
@@ -320,7 +657,7 @@ int getCursorPosition(int *rows, int *cols) {
     if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1; // write 4 bytes to stdout
 
     while (i < sizeof(buf) - 1) {
-        if (read(STDIN_FILENO, &buf[i], 1) != 1) break; // read 1 byte from stdin into buf[i]
+        if (!editorInputByte(&buf[i], INPUT_TIMEOUT_MS)) break; // take 1 byte of input into buf[i]
         if (buf[i] == 'R') break; // stop reading if we encounter 'R'
         i++;
     }
@@ -386,27 +723,402 @@ int getWindowSize(int *rows, int *cols) {
     }
 }
 
+/*** row storage ***/
+
+rownode *rowNodeNew(int leaf) {
+    rownode *node = calloc(1, sizeof(rownode));
+    node->leaf = leaf;
+    if (leaf) node->rows = malloc(sizeof(erow) * ROW_NODE_MAX);
+    else node->child = malloc(sizeof(rownode *) * ROW_NODE_MAX);
+    return node;
+}
+
+void rowLeafSetRendered(rownode *leaf) { // flags leaf as holding materialized rows, and adds it to E.renderedleaves
+    if (leaf->rendered) return;
+    leaf->rendered = 1;
+    leaf->rprev = NULL;
+    leaf->rnext = E.renderedleaves;
+    if (E.renderedleaves) E.renderedleaves->rprev = leaf;
+    E.renderedleaves = leaf;
+}
+
+void rowLeafClearRendered(rownode *leaf) {
+    if (!leaf->rendered) return;
+    leaf->rendered = 0;
+    if (leaf->rprev) leaf->rprev->rnext = leaf->rnext;
+    else E.renderedleaves = leaf->rnext;
+    if (leaf->rnext) leaf->rnext->rprev = leaf->rprev;
+}
+
+void rowNodeFree(rownode *node) {
+    if (node->leaf) rowLeafClearRendered(node);
+    free(node->rows);
+    free(node->child);
+    free(node);
+}
+
+int rowNodeIndex(rownode *node) { // position of node among its parent's children
+    int i = 0;
+    while (node->parent->child[i] != node) i++;
+    return i;
+}
+
+/**
+ * `rowTreeFind()`
+ * descends from the root to the leaf holding row `at` and stores the row's position inside that leaf in *pos.
+ * at == E.numrows lands one past the last row of the last leaf, which is where an appended row goes.
+*/
+rownode *rowTreeFind(int at, int *pos) {
+    rownode *node = E.rowroot;
+    while (!node->leaf) {
+        int i;
+        for (i = 0; i < node->n - 1 && at >= node->child[i]->count; i++) at -= node->child[i]->count;
+        node = node->child[i];
+    }
+    *pos = at;
+    return node;
+}
+
+rownode *rowTreeFirstLeaf() {
+    rownode *node = E.rowroot;
+    while (!node->leaf) node = node->child[0];
+    return node;
+}
+
+erow *editorRowAt(int at) {
+    if (at < 0 || at >= E.rowroot->count) return NULL;
+    int pos;
+    rownode *leaf = rowTreeFind(at, &pos);
+    return &leaf->rows[pos];
+}
+
+/**
+ * `editorRowIndex()`
+ * rows don't store their line number, so it never has to be renumbered when rows are inserted or deleted.
+ * It is derived instead: the row's position in its leaf plus the counts of every subtree left of the path to the root.
+*/
+int editorRowIndex(erow *row) {
+    rownode *node = row->leaf;
+    int at = row - node->rows;
+    for (; node->parent; node = node->parent) {
+        int i;
+        for (i = 0; node->parent->child[i] != node; i++) at += node->parent->child[i]->count;
+    }
+    return at;
+}
+
+erow *editorRowPrev(erow *row) {
+    rownode *leaf = row->leaf;
+    if (row > leaf->rows) return row - 1;
+    return leaf->prev ? &leaf->prev->rows[leaf->prev->n - 1] : NULL;
+}
+
+erow *editorRowNext(erow *row) {
+    rownode *leaf = row->leaf;
+    if (row - leaf->rows + 1 < leaf->n) return row + 1;
+    return leaf->next ? &leaf->next->rows[0] : NULL;
+}
+
+/**
+ * `rowNodeSplit()`
+ * moves the upper half of a full node into a new right sibling.
+ * The parent gains a child and is split in turn when it fills up; splitting the root grows the tree by one level.
+ * When rows are being appended (loading a file) only the last entry moves,
+ * so the nodes left behind stay full instead of half empty.
+*/
+void rowNodeSplit(rownode *node, int append) {
+    rownode *sib = rowNodeNew(node->leaf);
+    int half = append ? node->n - 1 : node->n / 2;
+    int j;
+
+    sib->n = node->n - half;
+    if (node->leaf) {
+        memcpy(sib->rows, &node->rows[half], sizeof(erow) * sib->n);
+        for (j = 0; j < sib->n; j++) sib->rows[j].leaf = sib;
+        sib->count = sib->n;
+        if (node->rendered) rowLeafSetRendered(sib);
+        sib->edited = node->edited;
+
+        sib->prev = node;
+        sib->next = node->next;
+        if (node->next) node->next->prev = sib;
+        node->next = sib;
+    } else {
+        memcpy(sib->child, &node->child[half], sizeof(rownode *) * sib->n);
+        for (j = 0; j < sib->n; j++) {
+            sib->child[j]->parent = sib;
+            sib->count += sib->child[j]->count;
+        }
+    }
+    node->n = half;
+
+    rownode *parent = node->parent;
+    if (parent == NULL) { // node is the root
+        parent = rowNodeNew(0);
+        parent->n = 1;
+        parent->child[0] = node;
+        parent->count = node->count;
+        node->parent = parent;
+        E.rowroot = parent;
+    }
+    node->count -= sib->count;
+
+    int i = rowNodeIndex(node);
+    memmove(&parent->child[i + 2], &parent->child[i + 1], sizeof(rownode *) * (parent->n - i - 1));
+    parent->child[i + 1] = sib;
+    sib->parent = parent;
+    parent->n++;
+    if (parent->n == ROW_NODE_MAX) rowNodeSplit(parent, append && i + 2 == parent->n);
+}
+
+void rowNodeUnlink(rownode *node) { // remove a node that no longer holds any row from its parent
+    rownode *parent = node->parent;
+    int i = rowNodeIndex(node);
+    memmove(&parent->child[i], &parent->child[i + 1], sizeof(rownode *) * (parent->n - i - 1));
+    parent->n--;
+
+    if (node->leaf) {
+        if (node->prev) node->prev->next = node->next;
+        if (node->next) node->next->prev = node->prev;
+    }
+    rowNodeFree(node);
+}
+
+/**
+ * `rowTreeInsert()`
+ * opens a slot for a new row at `at` and returns it. The caller fills in the row.
+*/
+erow *rowTreeInsert(int at) {
+    int pos;
+    rownode *leaf = rowTreeFind(at, &pos);
+    rownode *node;
+
+    memmove(&leaf->rows[pos + 1], &leaf->rows[pos], sizeof(erow) * (leaf->n - pos)); // at most ROW_NODE_MAX rows move
+    leaf->n++;
+    for (node = leaf; node; node = node->parent) node->count++;
+    leaf->rows[pos].leaf = leaf;
+    leaf->edited = 1;
+
+    if (leaf->n == ROW_NODE_MAX) {
+        rowNodeSplit(leaf, at == E.rowroot->count - 1); // the new row is the last one
+        return editorRowAt(at); // the row may have moved to the new sibling
+    }
+    return &leaf->rows[pos];
+}
+
+/**
+ * `rowTreeDelete()`
+ * removes row `at` from the tree. The caller frees the row's memory first.
+ * Empty nodes are unlinked, a small leaf is merged into its right sibling,
+ * and a root left with a single child is replaced by that child.
+*/
+void rowTreeDelete(int at) {
+    int pos;
+    rownode *leaf = rowTreeFind(at, &pos);
+    rownode *node;
+    int j;
+
+    memmove(&leaf->rows[pos], &leaf->rows[pos + 1], sizeof(erow) * (leaf->n - pos - 1));
+    leaf->n--;
+    for (node = leaf; node; node = node->parent) node->count--;
+    leaf->edited = 1; // the rows on either side of the removed one are no longer back to back
+
+    node = leaf;
+    if (node->n > 0) {
+        rownode *next = node->next;
+        if (next && next->parent == node->parent && node->n + next->n <= ROW_NODE_MAX / 2) { // merge into the right sibling's slot
+            memcpy(&node->rows[node->n], next->rows, sizeof(erow) * next->n);
+            for (j = node->n; j < node->n + next->n; j++) node->rows[j].leaf = node;
+            node->n += next->n;
+            node->count += next->count;
+            if (next->rendered) rowLeafSetRendered(node);
+            node->edited |= next->edited;
+            next->n = 0;
+            next->count = 0;
+            node = next;
+        }
+    }
+    while (node->parent && node->n == 0) {
+        rownode *parent = node->parent;
+        rowNodeUnlink(node);
+        node = parent;
+    }
+
+    if (E.rowroot->n == 0 && !E.rowroot->leaf) { // every row is gone
+        rowNodeFree(E.rowroot);
+        E.rowroot = rowNodeNew(1);
+    }
+    while (!E.rowroot->leaf && E.rowroot->n == 1) {
+        node = E.rowroot;
+        E.rowroot = node->child[0];
+        E.rowroot->parent = NULL;
+        rowNodeFree(node);
+    }
+}
+
+/**
+ * `rowTreeBuild()`
+ * builds the inner levels of a tree on top of nodes (the already filled leaves, in order) and returns the root.
+ * Used to load a file in one go instead of inserting its rows one by one. nodes is reused for every level.
+*/
+rownode *rowTreeBuild(rownode **nodes, int n) {
+    while (n > 1) {
+        int m = 0;
+        for (int i = 0; i < n; i += ROW_NODE_MAX - 1) { // a node is split once it is full, so stay one short of that
+            rownode *parent = rowNodeNew(0);
+            for (int j = i; j < n && j < i + ROW_NODE_MAX - 1; j++) {
+                parent->child[parent->n++] = nodes[j];
+                parent->count += nodes[j]->count;
+                nodes[j]->parent = parent;
+            }
+            nodes[m++] = parent;
+        }
+        n = m;
+    }
+    nodes[0]->parent = NULL;
+    return nodes[0];
+}
+
 /*** syntax highlighting ***/
 
-int is_seperator(int c) {
+/**
+ * `keywordTrieBuild()`
+ * compiles a NULL-terminated keyword list. Keywords ending in '|' are HL_KEYWORD2, the rest HL_KEYWORD1;
+ * if a keyword is listed twice, the first one counts.
+ * Returns NULL if the keywords could take more than KEYWORD_TRIE_NODES_MAX nodes, or memory runs out.
+*/
+struct keywordTrie *keywordTrieBuild(char **keywords) {
+    struct keywordTrie *t = calloc(1, sizeof(*t));
+    int nnodes = 1, maxnodes = 1;
+    int j, k;
+
+    if (t == NULL) return NULL;
+
+    t->nclasses = 1;
+    for (j = 0; keywords && keywords[j]; j++) {
+        for (k = 0; keywords[j][k]; k++) {
+            unsigned char c = keywords[j][k];
+            if (c == '|' && keywords[j][k + 1] == '\0') break; // the KEYWORD2 mark, not part of the keyword
+            if (!t->cls[c]) t->cls[c] = t->nclasses++;
+            maxnodes++; // each byte of a keyword adds a node at most
+        }
+    }
+    if (maxnodes > KEYWORD_TRIE_NODES_MAX) { // node ids would wrap around
+        free(t);
+        return NULL;
+    }
+    t->next = calloc((size_t)maxnodes * t->nclasses, sizeof(*t->next));
+    t->match = calloc(maxnodes, 1);
+    if (t->next == NULL || t->match == NULL) {
+        free(t->next);
+        free(t->match);
+        free(t);
+        return NULL;
+    }
+
+    for (j = 0; keywords && keywords[j]; j++) {
+        int klen = strlen(keywords[j]); // keyword length
+        int kw2 = klen > 0 && keywords[j][klen - 1] == '|'; // 1 if keyword ends with '|', 0 otherwise
+        if (kw2) klen--; // if keyword ends with '|', decrement keyword length
+        if (klen == 0) continue;
+
+        int node = 0;
+        for (k = 0; k < klen; k++) {
+            unsigned short *slot = &t->next[node * t->nclasses + t->cls[(unsigned char)keywords[j][k]]];
+            if (*slot == 0) *slot = nnodes++;
+            node = *slot;
+        }
+        if (t->match[node] == HL_NORMAL) t->match[node] = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+    }
+    return t;
+}
+
+/**
+ * `editorSyntaxCompile()`
+ * works out the tables the highlighter runs on from the description of a syntax, once, when it is first selected:
+ * the class of every character, and the keyword trie.
+ * Returns -1 if the keyword trie can't be built (see keywordTrieBuild()), 0 otherwise.
+*/
+int editorSyntaxCompile(struct editorSyntax *s) {
+    char *delims[3] = { s->singleline_comment_start, s->multiline_comment_start, s->multiline_comment_end };
+    unsigned char *cc = s->cclass;
+
+    memset(cc, 0, sizeof(s->cclass));
     /**
      * '\0' is the null character.
      * It can count the null byte at the end of each line as a separator.
     */
-    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL; // strchr() returns a pointer to the first occurrence of c in the string
+    cc['\0'] |= CC_SEPARATOR;
+    for (int c = '\t'; c <= '\r'; c++) cc[c] |= CC_SEPARATOR; // whitespace, as isspace() has it in the C locale
+    cc[' '] |= CC_SEPARATOR;
+    for (char *p = s->separators; p && *p; p++) cc[(unsigned char)*p] |= CC_SEPARATOR;
+    if (s->flags & HL_HIGHLIGHT_NUMBERS) {
+        for (int c = '0'; c <= '9'; c++) cc[c] |= CC_DIGIT;
+    }
+    if (s->flags & HL_HIGHLIGHT_STRINGS) {
+        cc['"'] |= CC_QUOTE;
+        cc['\''] |= CC_QUOTE;
+    }
+    for (int j = 0; j < 3; j++) {
+        if (delims[j] && delims[j][0]) cc[(unsigned char)delims[j][0]] |= CC_COMMENT; // only these need a closer look
+    }
+
+    s->kwtrie = keywordTrieBuild(s->keywords);
+    return s->kwtrie ? 0 : -1;
 }
 
-void editorUpdateSyntax(erow *row) {
-    row->hl = realloc(row->hl, row->rsize); // allocate memory for highlight array
-    memset(row->hl, HL_NORMAL, row->rsize); // memset() fills the first n bytes of the memory area pointed to by row->hl with the constant byte HL_NORMAL
+/**
+ * `keywordMatch()`
+ * returns the highlight of the keyword s starts with, if it is followed by a separator, and puts its length in *len.
+ * Returns HL_NORMAL if there is none. s must be null terminated.
+*/
+int keywordMatch(struct editorSyntax *syntax, const char *s, int *len) {
+    struct keywordTrie *t = syntax->kwtrie;
+    int node = 0;
+    for (int k = 0; ; k++) {
+        if (t->match[node] != HL_NORMAL && (syntax->cclass[(unsigned char)s[k]] & CC_SEPARATOR)) {
+            *len = k;
+            return t->match[node];
+        }
+        int c = t->cls[(unsigned char)s[k]];
+        if (c == 0) return HL_NORMAL; // a byte no keyword has, the null at the end included
+        node = t->next[node * t->nclasses + c];
+        if (node == 0) return HL_NORMAL;
+    }
+}
+
+/**
+ * `memchr2()`
+ * is memchr() for either of two bytes: returns the first a or b in [p, end), or end if there is neither.
+ * With SSE2 it compares 16 bytes at a time, as editorLoadChunk() does looking for newlines.
+*/
+const char *memchr2(const char *p, const char *end, char a, char b) {
+#ifdef __SSE2__
+    __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b);
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        unsigned int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb))); // bit i is set if p[i] is a or b
+        if (mask) return p + __builtin_ctz(mask);
+    }
+#endif
+    while (p < end && *p != a && *p != b) p++;
+    return p;
+}
 
-    if (E.syntax == NULL) return; // if no syntax, return
+/**
+ * `editorHighlight()`
+ * highlights render (the rendered text of a row) into hl with syntax,
+ * starting in_comment (the multi line comment state the previous row ends in), and returns the state this row ends in.
+ * It only looks at its arguments, so the highlighting worker thread can call it too.
+*/
+int editorHighlight(struct editorSyntax *syntax, char *render, int rsize, unsigned char *hl, int in_comment) {
+    memset(hl, HL_NORMAL, rsize); // memset() fills the first n bytes of the memory area pointed to by hl with the constant byte HL_NORMAL
 
-    char **keywords = E.syntax->keywords; // keywords
+    if (syntax == NULL) return 0; // if no syntax, return
 
-    char *scs = E.syntax->singleline_comment_start; // single line comment start
-    char *mcs = E.syntax->multiline_comment_start; // multi line comment start
-    char *mce = E.syntax->multiline_comment_end; // multi line comment end
+    char *scs = syntax->singleline_comment_start; // single line comment start
+    char *mcs = syntax->multiline_comment_start; // multi line comment start
+    char *mce = syntax->multiline_comment_end; // multi line comment end
 
     int scs_len = scs ? strlen(scs) : 0; // single line comment start length
     int mcs_len = mcs ? strlen(mcs) : 0; // multi line comment start length
@@ -414,14 +1126,16 @@ void editorUpdateSyntax(erow *row) {
     
     int prev_sep = 1; // previous separator; 1 if previous character is a separator, 0 otherwise. we consider the beginning of the line to be a separator. (Otherwise numbers at the very beginning of the line wouldn’t be highlighted.)
     int in_string = 0; // if in_string > 0 we are inside a string, 0 otherwise
-    int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment); // if in_comment > 0, we are inside a multi line comment, 0 otherwise (if previous row is a multi line comment
+
+    unsigned char *cclass = syntax->cclass; // a table lookup per character tells what it may be
 
     int i = 0;
-    while (i < row->rsize) {
-        char c = row->render[i];
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL; // previous highlight
+    while (i < rsize) {
+        char c = render[i];
+        unsigned char cls = cclass[(unsigned char)c]; // CC_* classes of c
+        unsigned char prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL; // previous highlight
 
-        if (scs_len && !in_string && !in_comment) { // if single line comment start exists and we are not in a string
+        if (scs_len && !in_string && !in_comment && (cls & CC_COMMENT)) { // if single line comment start exists and we are not in a string
             /**
              * `strncmp()`
              * strncmp() compares the first n bytes of s1 and s2.
@@ -429,17 +1143,24 @@ void editorUpdateSyntax(erow *row) {
              * A positive value means that s1 would be after s2 in a dictionary.
              * A negative value means that s1 would be before s2 in a dictionary.
             */
-            if (!strncmp(&row->render[i], scs, scs_len)) { // strncmp() compares the first n bytes of row->render[i] and scs
-                memset(&row->hl[i], HL_COMMENT, row->rsize - i); // highlight comment
+            if (!strncmp(&render[i], scs, scs_len)) { // strncmp() compares the first n bytes of render[i] and scs
+                memset(&hl[i], HL_COMMENT, rsize - i); // highlight comment
                 break;
             }
         }
 
         if (mcs_len && mce_len && !in_string) {
             if (in_comment) { // if in_comment > 0, we are inside a multi line comment
-                row->hl[i] = HL_MLCOMMENT; // highlight multi line comment
-                if (!strncmp(&row->render[i], mce, mce_len)) { // strncmp() compares the first n bytes of row->render[i] and mce
-                    memset(&row->hl[i], HL_MLCOMMENT, mce_len); // highlight multi line comment
+                if (c != mce[0]) { // nothing but the end of the comment matters in it: skip to the next byte it could start at
+                    char *next = memchr(&render[i], mce[0], rsize - i);
+                    int skip = next ? next - &render[i] : rsize - i;
+                    memset(&hl[i], HL_MLCOMMENT, skip);
+                    i += skip;
+                    continue;
+                }
+                hl[i] = HL_MLCOMMENT; // highlight multi line comment
+                if (!strncmp(&render[i], mce, mce_len)) { // strncmp() compares the first n bytes of render[i] and mce
+                    memset(&hl[i], HL_MLCOMMENT, mce_len); // highlight multi line comment
                     i += mce_len;
                     in_comment = 0;
                     prev_sep = 1;
@@ -448,131 +1169,639 @@ void editorUpdateSyntax(erow *row) {
                     i++;
                     continue;
                 }
-            } else if (!strncmp(&row->render[i], mcs, mcs_len)) { // strncmp() compares the first n bytes of row->render[i] and mcs
-                memset(&row->hl[i], HL_MLCOMMENT, mcs_len); // highlight multi line comment
+            } else if ((cls & CC_COMMENT) && !strncmp(&render[i], mcs, mcs_len)) { // strncmp() compares the first n bytes of render[i] and mcs
+                memset(&hl[i], HL_MLCOMMENT, mcs_len); // highlight multi line comment
                 i += mcs_len;
                 in_comment = 1;
                 continue;
             }
         }
         
-        if (E.syntax->flags * HL_HIGHLIGHT_STRINGS) {
-            if (in_string) {
-                row->hl[i] = HL_STRING; // highlight string
-                if (c == '\\' && i + 1 < row->rsize) {
-                    row->hl[i + 1] = HL_STRING; // highlight escape character
-                    i += 2;
-                    continue;
-                }
-                if (c == in_string) in_string = 0; // if c is the same as in_string, set in_string to 0
-                i++;
+        if (in_string) { // strings only start at a CC_QUOTE, which there are none of without HL_HIGHLIGHT_STRINGS
+            if (c != in_string && c != '\\') { // likewise, only the closing quote or an escape matters in a string
+                int skip = memchr2(&render[i], &render[rsize], in_string, '\\') - &render[i];
+                memset(&hl[i], HL_STRING, skip);
+                i += skip;
                 prev_sep = 1;
                 continue;
-            } else {
-                if (c == '"' || c == '\'') { // if c is a double quote or single quote
-                    in_string = c; // set in_string to c
-                    row->hl[i] = HL_STRING; // highlight string
-                    i++;
-                    continue;
-                }
             }
-        }
-        
-        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-            if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) || 
-                (c == '.' && prev_hl == HL_NUMBER)) { // if c is a digit and previous character is a separator or previous character is a number, or if c is a decimal point and previous character is a number
-                row->hl[i] = HL_NUMBER; // highlight numbers
-                i++;
-                prev_sep = 0;
+            hl[i] = HL_STRING; // highlight string
+            if (c == '\\' && i + 1 < rsize) {
+                hl[i + 1] = HL_STRING; // highlight escape character
+                i += 2;
                 continue;
             }
+            if (c == in_string) in_string = 0; // if c is the same as in_string, set in_string to 0
+            i++;
+            prev_sep = 1;
+            continue;
+        } else if (cls & CC_QUOTE) { // if c is a double quote or single quote
+            in_string = c; // set in_string to c
+            hl[i] = HL_STRING; // highlight string
+            i++;
+            continue;
+        }
+
+        // no CC_DIGIT without HL_HIGHLIGHT_NUMBERS, and so no HL_NUMBER for a '.' to follow either
+        if (((cls & CC_DIGIT) && (prev_sep || prev_hl == HL_NUMBER)) || 
+            (c == '.' && prev_hl == HL_NUMBER)) { // if c is a digit and previous character is a separator or previous character is a number, or if c is a decimal point and previous character is a number
+            hl[i] = HL_NUMBER; // highlight numbers
+            i++;
+            prev_sep = 0;
+            continue;
         }
 
         if (prev_sep) { // if previous character is a separator
-            int j;
-            for (j = 0; keywords[j]; j++) {
-                int klen = strlen(keywords[j]); // keyword length
-                int kw2 = keywords[j][klen - 1] == '|'; // 1 if keyword ends with '|', 0 otherwise
-                if (kw2) klen--; // if keyword ends with '|', decrement keyword length
-
-                if (!strncmp(&row->render[i], keywords[j], klen) &&
-                    is_seperator(row->render[i + klen])) { // if keyword matches and next character is a separator
-                    memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen); // highlight keyword
-                    i += klen;
-                    break;
-                }
-            }
-            if (keywords[j] != NULL) { // if keyword matches
+            int klen;
+            int kw = keywordMatch(syntax, &render[i], &klen); // one walk down the trie, however many keywords there are
+            if (kw != HL_NORMAL) { // if keyword matches and next character is a separator
+                memset(&hl[i], kw, klen); // highlight keyword
+                i += klen;
                 prev_sep = 0;
                 continue;
             }
         }
 
-        prev_sep = is_seperator(c);
+        prev_sep = (cls & CC_SEPARATOR) != 0;
         i++;
+        if (!prev_sep) {
+            while (i < rsize && cclass[(unsigned char)render[i]] == 0) i++; // the rest of a word stays HL_NORMAL: classless bytes don't start anything after a non-separator
+        }
     }
 
-    int changed = (row->hl_open_comment != in_comment); // 1 if row->hl_open_comment != in_comment, 0 otherwise
-    row->hl_open_comment = in_comment; // set row->hl_open_comment to in_comment
-    if (changed && row->idx + 1 < E.numrows) editorUpdateSyntax(&E.row[row->idx + 1]); // if changed and row->idx + 1 < E.numrows, update syntax of next row
+    return in_comment;
 }
 
-int editorSyntaxToColor(int hl) {
-    switch (hl) {
-        case HL_COMMENT: 
-        case HL_MLCOMMENT: return 36; // cyan
-        case HL_KEYWORD1: return 33; // yellow
-        case HL_KEYWORD2: return 32; // green
-        case HL_STRING: return 35; // magenta
-        case HL_NUMBER: return 31; // red
-        case HL_MATCH: return 34; // blue
-        default: return 37; // white
-    }
+int editorSyntaxMultiline(struct editorSyntax *syntax) { // returns 1 if rows can end inside a multi line comment of syntax
+    return syntax && syntax->multiline_comment_start && syntax->multiline_comment_start[0]
+        && syntax->multiline_comment_end && syntax->multiline_comment_end[0];
 }
 
-void editorSelectSyntaxHighlight() {
-    E.syntax = NULL;
-    if (E.filename == NULL) return; // if no filename, return
+int editorRowInComment(erow *row) { // returns 1 if row starts inside a multi line comment: the state the row before it ends in
+    erow *prev = editorRowPrev(row); // previous row, or NULL on the first row
+    return prev && prev->hl_open_comment;
+}
 
-    char *ext = strrchr(E.filename, '.'); // strrchr() returns a pointer to the last occurrence of the character '.' in the string E.filename. If no match is found, then NULL is returned.
+/**
+ * `hlRuns()`
+ * finds the runs of hl (len highlights, one per character) that aren't HL_NORMAL,
+ * stores them in spans unless it is NULL, and returns how many there are.
+*/
+int hlRuns(const unsigned char *hl, int len, struct hlspan *spans) {
+    int n = 0;
+    int i = 0;
+    while (i < len) {
+        int start = i;
+        unsigned char h = hl[i];
+        while (i < len && hl[i] == h) i++;
+        if (h == HL_NORMAL) continue;
+        if (spans) spans[n] = (struct hlspan){ start, i - start, h };
+        n++;
+    }
+    return n;
+}
 
-    for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-        struct editorSyntax *s = &HLDB[j];
-        unsigned int i = 0;
-        while (s->filematch[i]) {
-            int is_ext = (s->filematch[i][0] == '.');
-            /**
-             * `strcmp()`
-             * strcmp() compares the two strings s1 and s2.
-             * It returns an integer less than, equal to, or greater than zero if s1 is found, respectively, to be less than, to match, or be greater than s2.
-             * A positive value means that s1 would be after s2 in a dictionary.
-             * A negative value means that s1 would be before s2 in a dictionary.
-            */
-            if ((is_ext && ext && !strcmp(ext, s->filematch[i])) || // strcmp() returns 0 if the strings are equal. In C, 0 is false, and any other integer is true.
-                (!is_ext && strstr(E.filename, s->filematch[i]))) { // strstr() returns a pointer to the first occurrence of s->filematch[i] in E.filename
-                E.syntax = s;
+void editorRowSetHl(erow *row, const unsigned char *hl) { // keeps hl, a highlight per render column of row, as spans
+    row->nhl = hlRuns(hl, row->rsize, NULL);
+    row->hl = realloc(row->hl, sizeof(struct hlspan) * (row->nhl + 1));
+    hlRuns(hl, row->rsize, row->hl);
+}
 
-                int filerow;
-                for (filerow = 0; filerow < E.numrows; filerow++) {
-                    editorUpdateSyntax(&E.row[filerow]);
-                }
+/**
+ * `editorRowExpandHl()`
+ * writes the highlight of len render columns of row, from col on, into out: a byte per column, for drawing.
+ * A binary search finds the first span that reaches col, so only the spans in view are looked at.
+*/
+void editorRowExpandHl(erow *row, int col, int len, unsigned char *out) {
+    memset(out, HL_NORMAL, len);
+    int lo = 0, hi = row->nhl;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (row->hl[mid].start + row->hl[mid].len <= col) lo = mid + 1;
+        else hi = mid;
+    }
+    for (int j = lo; j < row->nhl && row->hl[j].start < col + len; j++) {
+        int from = row->hl[j].start > col ? row->hl[j].start : col;
+        int to = row->hl[j].start + row->hl[j].len;
+        if (to > col + len) to = col + len;
+        memset(&out[from - col], row->hl[j].hl, to - from);
+    }
+}
 
-                return;
-            }
-            i++;
-        }
+void editorRowUnhighlight(erow *row) { // a row whose starting state isn't known yet is drawn plain, until catching up gets to it
+    row->nhl = 0;
+}
+
+/**
+ * `editorRowHighlight()`
+ * re-highlights a row and returns the multi line comment state it ends in.
+ * Rows are highlighted into a scratch buffer that is reused for every row, a byte per character;
+ * a materialized row (see editorRowMaterialize()) keeps the result as spans.
+ * For one that isn't, we only need the state it ends in, and its hl is built once it is drawn.
+*/
+int editorRowHighlight(erow *row) {
+    static char *render = NULL; // scratch render
+    static unsigned char *hl = NULL; // scratch highlight
+
+    if (row->render) {
+        hl = realloc(hl, row->rsize + 1);
+        int in_comment = editorHighlight(E.syntax, row->render, row->rsize, hl, editorRowInComment(row));
+        editorRowSetHl(row, hl); // the row keeps the spans, the scratch goes to the next row
+        return in_comment;
     }
+    if (E.syntax == NULL) return 0;
+
+    int rsize;
+    render = editorRenderText(row, render, &rsize);
+    hl = realloc(hl, rsize + 1);
+    return editorHighlight(E.syntax, render, rsize, hl, editorRowInComment(row));
 }
 
-/*** row operations ***/
+void editorSyntaxPending(int end) { // rows before end must be re-highlighted before catching up may stop
+    if (E.hlpending < end) E.hlpending = end;
+}
 
 /**
- * `editorRowCxToRx()`
- * 
- * if it’s a tab we use rx % KILO_TAB_STOP to find out how many columns we are to the right of the last tab stop,
- * and then subtract that from KILO_TAB_STOP - 1 to find out how many columns we are to the left of the next tab stop.
- * 
- * Why rx % TAB_STOP?
+ * `editorUpdateSyntaxRows()`
+ * re-highlights n rows from row on, which were just edited (0 if only the row before row changed),
+ * then the rows after them for as long as the multi line comment state they end in keeps changing.
+ * Opening a comment near the top can change every row below, so only rows down to the bottom of the screen are done here:
+ * the rest is left to editorSyntaxCatchUp(), from E.hlfrontier on.
+*/
+void editorUpdateSyntaxRows(erow *row, int n) {
+    if (!editorSyntaxMultiline(E.syntax)) { // every row ends in state 0: no row but the edited ones can change
+        for (; row && n > 0; row = editorRowNext(row), n--) editorRowHighlight(row);
+        return;
+    }
+
+    int at = editorRowIndex(row);
+    int last = E.rowoff + E.screenrows; // rows before this are highlighted right away
+
+    for (; row; row = editorRowNext(row), at++, n--) {
+        if (n <= 0 && at >= last && at < E.hlfrontier) E.hlfrontier = at; // off screen: later
+        if (at >= E.hlfrontier) { // the state this row starts in isn't known yet: catching up gets to it, and the rest of the edit
+            editorSyntaxPending(at + (n > 0 ? n : 1));
+            editorHighlightJobEdit(at, 0);
+            for (; row && n > 0; row = editorRowNext(row), n--) {
+                if (row->render) editorRowUnhighlight(row); // edited rows on screen get colors back once caught up
+            }
+            return;
+        }
+
+        int in_comment = editorRowHighlight(row);
+        int changed = (row->hl_open_comment != in_comment); // 1 if row->hl_open_comment != in_comment, 0 otherwise
+        row->hl_open_comment = in_comment; // set row->hl_open_comment to in_comment
+        if (!changed && n <= 1) return; // the rows after it start in the same state as before
+    }
+}
+
+/**
+ * `editorUpdateSyntax()`
+ * re-highlights a row and keeps its hl_open_comment, and those of the rows after it, up to date.
+*/
+void editorUpdateSyntax(erow *row) {
+    editorUpdateSyntaxRows(row, 1);
+}
+
+/**
+ * `editorSyntaxCatchUp()`
+ * re-highlights rows from E.hlfrontier on, until every row before until ends in the right multi line comment state.
+ * It is done for good at the first row past E.hlpending whose state didn't change: the rows after it were right already.
+*/
+void editorSyntaxCatchUp(int until) {
+    if (E.hlfrontier >= until || E.hlfrontier >= E.numrows) return;
+
+    int at = E.hlfrontier;
+    erow *row;
+    for (row = editorRowAt(at); row && at < until; row = editorRowNext(row)) {
+        int in_comment = editorRowHighlight(row); // the row before it is right, so this one comes out right
+        int changed = (row->hl_open_comment != in_comment);
+        row->hl_open_comment = in_comment;
+        at++;
+        if (!changed && at >= E.hlpending) { // caught up
+            at = E.numrows;
+            break;
+        }
+    }
+    E.hlfrontier = at;
+    if (E.hlfrontier == E.numrows) E.hlpending = 0;
+}
+
+/**
+ * `highlightJob`
+ * Rows from E.hlfrontier on, copied for the highlighting worker thread to find the multi line comment state each one ends in.
+ * The thread only sees the copy, so the rows may be edited meanwhile:
+ * editorHighlightJobEdit() keeps track of how many of them are still as they were, and only their results are taken in.
+*/
+struct highlightJob {
+    pthread_t thread;
+    struct editorSyntax *syntax;
+    int start; // main thread only: the row the job starts at, which moves with rows inserted or deleted above it,
+    int valid; // and how many rows from there on no edit has touched since the job was made
+    int n; // rows in the job; cut short by the thread if it catches up
+    int pending; // rows that must be done before the thread may stop early (see E.hlpending)
+    int in_comment; // state the row before the first one ends in
+    char *text; // the rows, each followed by a newline
+    size_t *offs; // where each row starts in text; offs[n] is the end
+    unsigned char *states; // the rows' hl_open_comment going in, the states they end in coming out
+    int caughtup; // set by the thread: 1 if the rows after the job are right already
+};
+
+void *editorHighlightRun(void *arg) {
+    struct highlightJob *job = arg;
+    erow row; // stands in for the rows, so editorRenderText() can read the copied text
+    char *render = NULL;
+    unsigned char *hl = NULL;
+    int rsize;
+    int in_comment = job->in_comment;
+
+    for (int i = 0; i < job->n; i++) {
+        row.chars = &job->text[job->offs[i]];
+        row.size = row.gap = job->offs[i + 1] - job->offs[i] - 1;
+        row.gaplen = 0;
+        render = editorRenderText(&row, render, &rsize);
+        hl = realloc(hl, rsize + 1);
+        in_comment = editorHighlight(job->syntax, render, rsize, hl, in_comment);
+
+        int changed = (job->states[i] != in_comment);
+        job->states[i] = in_comment;
+        if (!changed && i + 1 >= job->pending) { // caught up, as in editorSyntaxCatchUp()
+            job->n = i + 1;
+            job->caughtup = 1;
+            break;
+        }
+    }
+    free(render);
+    free(hl);
+    editorWake(WAKE_HIGHLIGHT);
+    return NULL;
+}
+
+/**
+ * `editorHighlightJobEdit()`
+ * tells the running highlight job, if any, that row at was edited (delta 0), or a row inserted (1) or deleted (-1) there.
+ * Its results for rows from at on no longer fit, but those above at still do. An edit above the job's first row drops them all:
+ * the state that row starts in may have changed.
+*/
+void editorHighlightJobEdit(int at, int delta) {
+    struct highlightJob *job = E.hljob;
+    if (job == NULL) return;
+    if (at < job->start && delta != 0) job->start += delta; // lines come or go above it: its rows move with them
+    else if (at - job->start < job->valid) job->valid = at > job->start ? at - job->start : 0;
+}
+
+/**
+ * `editorHighlightStart()`
+ * hands the rows from E.hlfrontier on to a worker thread, unless one is busy already or there is nothing left to do.
+ * If the frontier is above the bottom of the screen, the job stops there, so the rows on screen get their colors first.
+*/
+void editorHighlightStart() {
+    if (E.hljob || E.hlfrontier >= E.numrows || !editorSyntaxMultiline(E.syntax)) return;
+
+    int n = E.numrows - E.hlfrontier;
+    int bottom = E.rowoff + E.screenrows - E.hlfrontier; // rows down to the bottom of the screen
+    if (n > HL_JOB_ROWS) n = HL_JOB_ROWS;
+    if (bottom > 0 && bottom < n) n = bottom;
+
+    struct highlightJob *job = malloc(sizeof(*job));
+    job->syntax = E.syntax;
+    job->start = E.hlfrontier;
+    job->valid = n;
+    job->n = n;
+    job->pending = E.hlpending - E.hlfrontier;
+    job->caughtup = 0;
+    job->offs = malloc(sizeof(size_t) * (n + 1));
+    job->states = malloc(n);
+
+    erow *row = editorRowAt(E.hlfrontier);
+    job->in_comment = editorRowInComment(row);
+    size_t len = 0;
+    erow *r = row;
+    for (int i = 0; i < n; i++, r = editorRowNext(r)) len += r->size + 1;
+    job->text = malloc(len);
+    len = 0;
+    for (int i = 0; i < n; i++, row = editorRowNext(row)) {
+        job->offs[i] = len;
+        job->states[i] = row->hl_open_comment;
+        len += editorRowCopy(row, &job->text[len]);
+    }
+    job->offs[n] = len;
+
+    if (pthread_create(&job->thread, NULL, editorHighlightRun, job) != 0) { // no thread: catch up here, a job's worth at a time
+        free(job->text);
+        free(job->offs);
+        free(job->states);
+        free(job);
+        editorSyntaxCatchUp(E.hlfrontier + n);
+        return;
+    }
+    E.hljob = job;
+}
+
+/**
+ * `editorHighlightFinish()`
+ * takes in the results of a finished highlight job, and starts the next one.
+ * Returns 1 if rows on screen got new colors.
+*/
+int editorHighlightFinish() {
+    struct highlightJob *job = E.hljob;
+    int shown = 0;
+    if (job == NULL) return 0;
+
+    pthread_join(job->thread, NULL);
+    E.hljob = NULL;
+    int from = E.hlfrontier - job->start; // catching up may have done some of the rows meanwhile
+    int valid = job->valid < job->n ? job->valid : job->n;
+    if (from >= 0 && from < valid) {
+        erow *row = editorRowAt(E.hlfrontier);
+        for (int i = from; i < valid; i++, row = editorRowNext(row)) {
+            row->hl_open_comment = job->states[i];
+            if (row->render) { // on screen: it was drawn plain so far
+                editorRowHighlight(row);
+                shown = 1;
+            }
+        }
+        E.hlfrontier = job->start + valid;
+        if (job->caughtup && valid == job->n && E.hlpending <= E.hlfrontier) E.hlfrontier = E.numrows; // nothing edited after it either
+        if (E.hlfrontier == E.numrows) E.hlpending = 0;
+    }
+    free(job->text);
+    free(job->offs);
+    free(job->states);
+    free(job);
+
+    editorHighlightStart();
+    return shown;
+}
+
+int editorSyntaxToColor(int hl) {
+    switch (hl) {
+        case HL_COMMENT: 
+        case HL_MLCOMMENT: return 36; // cyan
+        case HL_KEYWORD1: return 33; // yellow
+        case HL_KEYWORD2: return 32; // green
+        case HL_STRING: return 35; // magenta
+        case HL_NUMBER: return 31; // red
+        case HL_MATCH: return 34; // blue
+        default: return 37; // white
+    }
+}
+
+/**
+ * `syntaxListAdd()`
+ * appends a copy of word, with suffix after it, to the NULL-terminated list *list of *n words.
+*/
+void syntaxListAdd(char ***list, int *n, const char *word, const char *suffix) {
+    size_t len = strlen(word) + strlen(suffix) + 1;
+    char *w = malloc(len);
+    snprintf(w, len, "%s%s", word, suffix);
+    *list = realloc(*list, sizeof(char *) * (*n + 2));
+    (*list)[(*n)++] = w;
+    (*list)[*n] = NULL;
+}
+
+void syntaxListFree(char **list) {
+    for (int j = 0; list && list[j]; j++) free(list[j]);
+    free(list);
+}
+
+void syntaxSet(char **field, const char *value) {
+    free(*field);
+    *field = strdup(value);
+}
+
+void editorSyntaxFree(struct editorSyntax *s) {
+    free(s->filetype);
+    syntaxListFree(s->filematch);
+    syntaxListFree(s->keywords);
+    free(s->singleline_comment_start);
+    free(s->multiline_comment_start);
+    free(s->multiline_comment_end);
+    free(s->separators);
+}
+
+/**
+ * `editorSyntaxParse()`
+ * reads a syntax definition file into s. Each line is a setting: a name, then its values, split by whitespace.
+ * Lines starting with '#' are comments.
+ *
+ *     filetype c                       shown in the status bar
+ *     match .c .h Makefile             file name extensions (starting with '.'), or parts of a file name
+ *     keywords if else while ...       highlighted as HL_KEYWORD1. may be given over several lines, like match and types
+ *     types int char ...               highlighted as HL_KEYWORD2
+ *     comment //                       single line comment start
+ *     comment_start {-                 multi line comment start,
+ *     comment_end -}                   and end
+ *     separators ,.()+-=~%<>[];        characters besides whitespace that end a word
+ *     numbers                          highlight numbers
+ *     strings                          highlight strings in '' and ""
+ *
+ * Returns 0 if it filled in s, -1 if the file can't be read, doesn't say what files it is for,
+ * or has more than SYNTAX_KEYWORDS_MAX keywords and types or one longer than SYNTAX_KEYWORD_LEN_MAX:
+ * definition files come from anywhere, and that keeps what editorSyntaxCompile() builds from them small.
+ * The tables the highlighter runs on are compiled from s by editorSyntaxCompile(), as for the built in syntaxes.
+*/
+int editorSyntaxParse(const char *path, struct editorSyntax *s) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) return -1;
+
+    memset(s, 0, sizeof(*s));
+    int nmatch = 0, nkeywords = 0;
+    int toomany = 0; // 1 once the keywords go past the limits
+    char *line = NULL;
+    size_t linecap = 0;
+    while (getline(&line, &linecap, fp) != -1) {
+        const char *ws = " \t\r\n";
+        char *key = strtok(line, ws);
+        if (key == NULL || key[0] == '#') continue; // blank line or comment
+        char *val = strtok(NULL, ws);
+
+        if (!strcmp(key, "match") || !strcmp(key, "keywords") || !strcmp(key, "types")) {
+            for (; val; val = strtok(NULL, ws)) {
+                if (key[0] == 'm') syntaxListAdd(&s->filematch, &nmatch, val, "");
+                else if (nkeywords >= SYNTAX_KEYWORDS_MAX || strlen(val) > SYNTAX_KEYWORD_LEN_MAX) toomany = 1;
+                else syntaxListAdd(&s->keywords, &nkeywords, val, key[0] == 't' ? "|" : ""); // the '|' mark of HL_KEYWORD2
+            }
+        } else if (!strcmp(key, "numbers")) {
+            s->flags |= HL_HIGHLIGHT_NUMBERS;
+        } else if (!strcmp(key, "strings")) {
+            s->flags |= HL_HIGHLIGHT_STRINGS;
+        } else if (val == NULL) {
+            continue; // the rest need a value
+        } else if (!strcmp(key, "filetype")) {
+            syntaxSet(&s->filetype, val);
+        } else if (!strcmp(key, "comment")) {
+            syntaxSet(&s->singleline_comment_start, val);
+        } else if (!strcmp(key, "comment_start")) {
+            syntaxSet(&s->multiline_comment_start, val);
+        } else if (!strcmp(key, "comment_end")) {
+            syntaxSet(&s->multiline_comment_end, val);
+        } else if (!strcmp(key, "separators")) {
+            syntaxSet(&s->separators, val);
+        } // anything else is ignored, so that newer files still load
+    }
+    free(line);
+    fclose(fp);
+
+    if (s->filetype == NULL || s->filematch == NULL || toomany) {
+        editorSyntaxFree(s);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * `editorLoadSyntaxes()`
+ * loads every syntax definition file (see editorSyntaxParse()) in the syntax directory into E.syntaxes,
+ * in file name order. Files that don't parse are skipped, and without a directory there are only the built in syntaxes.
+*/
+void editorLoadSyntaxes() {
+    char *dir = getenv(SYNTAX_DIR_ENV);
+    char *home = getenv("HOME");
+    char *homedir = NULL;
+    if (dir == NULL) {
+        if (home == NULL) return;
+        size_t len = strlen(home) + sizeof("/" SYNTAX_DIR_HOME);
+        dir = homedir = malloc(len);
+        snprintf(homedir, len, "%s/" SYNTAX_DIR_HOME, home);
+    }
+
+    struct dirent **names;
+    int n = scandir(dir, &names, NULL, alphasort);
+    for (int j = 0; j < n; j++) {
+        if (names[j]->d_name[0] != '.') { // ".", ".." and hidden files
+            size_t len = strlen(dir) + strlen(names[j]->d_name) + 2;
+            char *path = malloc(len);
+            snprintf(path, len, "%s/%s", dir, names[j]->d_name);
+            struct editorSyntax s;
+            if (editorSyntaxParse(path, &s) == 0) {
+                E.syntaxes = realloc(E.syntaxes, sizeof(struct editorSyntax) * (E.nsyntaxes + 1));
+                E.syntaxes[E.nsyntaxes++] = s;
+            }
+            free(path);
+        }
+        free(names[j]);
+    }
+    if (n >= 0) free(names);
+    free(homedir);
+}
+
+struct editorSyntax *editorSyntaxMatch(char *filename) { // returns the syntax for filename, or NULL
+    if (filename == NULL) return NULL; // if no filename, return
+
+    char *ext = strrchr(filename, '.'); // strrchr() returns a pointer to the last occurrence of the character '.' in the string filename. If no match is found, then NULL is returned.
+
+    for (unsigned int j = 0; j < E.nsyntaxes + HLDB_ENTRIES; j++) {
+        struct editorSyntax *s = j < (unsigned int)E.nsyntaxes ? &E.syntaxes[j] : &HLDB[j - E.nsyntaxes]; // a definition file may override a built in syntax
+        unsigned int i = 0;
+        while (s->filematch[i]) {
+            int is_ext = (s->filematch[i][0] == '.');
+            /**
+             * `strcmp()`
+             * strcmp() compares the two strings s1 and s2.
+             * It returns an integer less than, equal to, or greater than zero if s1 is found, respectively, to be less than, to match, or be greater than s2.
+             * A positive value means that s1 would be after s2 in a dictionary.
+             * A negative value means that s1 would be before s2 in a dictionary.
+            */
+            if ((is_ext && ext && !strcmp(ext, s->filematch[i])) || // strcmp() returns 0 if the strings are equal. In C, 0 is false, and any other integer is true.
+                (!is_ext && strstr(filename, s->filematch[i]))) { // strstr() returns a pointer to the first occurrence of s->filematch[i] in filename
+                if (s->kwtrie == NULL && editorSyntaxCompile(s) == -1) return NULL; // before a highlight job can see the syntax. one that can't be compiled highlights nothing
+                return s;
+            }
+            i++;
+        }
+    }
+    return NULL;
+}
+
+void editorSelectSyntaxHighlight() {
+    struct editorSyntax *old = E.syntax;
+    E.syntax = editorSyntaxMatch(E.filename);
+    editorHighlightJobEdit(0, 0); // the job highlights with the old syntax
+    if (editorSyntaxMultiline(E.syntax)) {
+        E.hlfrontier = 0; // no row's state is known under the new syntax: catching up goes through the whole file
+        E.hlpending = E.numrows;
+        return;
+    }
+
+    /**
+     * Without multi line comments every row ends in state 0, so there is nothing to catch up on,
+     * and no highlight job need copy the file only to find that out. States left by the old syntax are cleared.
+    */
+    if (editorSyntaxMultiline(old)) {
+        for (erow *row = editorRowAt(0); row; row = editorRowNext(row)) row->hl_open_comment = 0;
+    }
+    E.hlfrontier = E.numrows;
+    E.hlpending = 0;
+}
+
+/*** row operations ***/
+
+/**
+ * `editorRowOwn()`
+ * A freshly opened row borrows its text from the original file buffer (E.orig), like a piece of a piece table.
+ * The first edit copies the text into the row's own buffer; until then the row costs no allocation.
+*/
+void editorRowOwn(erow *row) {
+    if (row->owned) return;
+    char *text = row->chars;
+    row->chars = malloc(row->size + 1);
+    memcpy(row->chars, text, row->size);
+    row->owned = 1;
+    row->leaf->edited = 1;
+}
+
+/**
+ * Each row keeps its text in a gap buffer.
+ * The free space sits at the cursor, so typing or deleting there only touches the gap: O(1) amortized.
+ * Moving the gap costs the distance it moves, and the buffer doubles when the gap runs out.
+ * The allocation is always size + gaplen + 1 bytes, so there is room for a '\0' once the gap is at the end.
+*/
+void editorRowMoveGap(erow *row, int at) {
+    if (at != row->gap) editorRowOwn(row); // a borrowed row has its (empty) gap at the end, so reading it never copies
+    if (at < row->gap) {
+        memmove(&row->chars[at + row->gaplen], &row->chars[at], row->gap - at); // shift text before the gap to its end
+    } else if (at > row->gap) {
+        memmove(&row->chars[row->gap], &row->chars[row->gap + row->gaplen], at - row->gap); // shift text after the gap to its start
+    }
+    row->gap = at;
+}
+
+void editorRowReserve(erow *row, int len) { // make sure the gap has room for len more chars
+    if (row->gaplen >= len) return;
+    editorRowOwn(row);
+
+    int cap = (row->size + row->gaplen) * 2;
+    if (cap < row->size + len) cap = row->size + len;
+    if (cap < ROW_GAP_MIN) cap = ROW_GAP_MIN;
+
+    int tail = row->size - row->gap; // text after the gap
+    row->chars = realloc(row->chars, cap + 1);
+    memmove(&row->chars[cap - tail], &row->chars[row->gap + row->gaplen], tail); // keep the tail at the end of the bigger buffer
+    row->gaplen = cap - row->size;
+}
+
+char editorRowCharAt(erow *row, int at) {
+    return row->chars[at < row->gap ? at : at + row->gaplen];
+}
+
+/**
+ * `editorRowChars()`
+ * returns the row's text as row->size contiguous bytes by moving the gap to the end.
+ * It is not null terminated: a borrowed row points into the original file buffer, which we never write to.
+*/
+char *editorRowChars(erow *row) {
+    editorRowMoveGap(row, row->size);
+    return row->chars;
+}
+
+/**
+ * `editorRowCxToRx()`
+ * 
+ * if it’s a tab we use rx % KILO_TAB_STOP to find out how many columns we are to the right of the last tab stop,
+ * and then subtract that from KILO_TAB_STOP - 1 to find out how many columns we are to the left of the next tab stop.
+ * 
+ * Why rx % TAB_STOP?
  * 
  * In TAB_STOP = 4,
  *     ↓   ↓
@@ -589,7 +1818,7 @@ int editorRowCxToRx(erow *row, int cx) {
     int rx = 0;
     int j;
     for (j = 0; j < cx; j++) {
-        if (row->chars[j] == '\t') rx += (TAB_STOP - 1) - (rx % TAB_STOP); // add number of spaces until next tab stop
+        if (editorRowCharAt(row, j) == '\t') rx += (TAB_STOP - 1) - (rx % TAB_STOP); // add number of spaces until next tab stop
         rx++;
     }
 
@@ -597,208 +1826,1024 @@ int editorRowCxToRx(erow *row, int cx) {
 }
 
 /**
- * `editorRowRxToCx()`
- * 
- * if it’s a tab we use cur_rx % KILO_TAB_STOP to find out how many columns we are to the right of the last tab stop,
- * and then subtract that from KILO_TAB_STOP - 1 to find out how many columns we are to the left of the next tab stop.
+ * `editorRowRxToCx()`
+ * 
+ * if it’s a tab we use cur_rx % KILO_TAB_STOP to find out how many columns we are to the right of the last tab stop,
+ * and then subtract that from KILO_TAB_STOP - 1 to find out how many columns we are to the left of the next tab stop.
+*/
+int editorRowRxToCx(erow *row, int rx) {
+    int cur_rx = 0;
+    int cx;
+    for (cx = 0; cx < row->size; cx++) {
+        if (editorRowCharAt(row, cx) == '\t') cur_rx += (TAB_STOP - 1) - (cur_rx % TAB_STOP); // add number of spaces until next tab stop
+        cur_rx++;
+
+        if (cur_rx > rx) return cx; // return index of character at cx
+    }
+
+    return cx;
+}
+
+/**
+ * `editorRenderText()`
+ * renders the row's text (tabs expanded to spaces) into buf, which is realloc()ed to fit, and stores its length in *rsize.
+*/
+char *editorRenderText(erow *row, char *buf, int *rsize) {
+    char *seg[2] = { row->chars, &row->chars[row->gap + row->gaplen] }; // the text on either side of the gap
+    int seglen[2] = { row->gap, row->size - row->gap };
+    int s, tabs = 0;
+    char *p, *end, *tab;
+
+    for (s = 0; s < 2; s++)
+        for (p = seg[s], end = p + seglen[s]; (tab = memchr(p, '\t', end - p)) != NULL; p = tab + 1) tabs++;
+
+    buf = realloc(buf, row->size + tabs * (TAB_STOP - 1) + 1); // TAP_STOP spaces for each tab(1 space is already in the size of the row)
+
+    int idx = 0;
+    for (s = 0; s < 2; s++) {
+        for (p = seg[s], end = p + seglen[s]; p < end; p = tab ? tab + 1 : end) {
+            tab = memchr(p, '\t', end - p);
+            int n = (tab ? tab : end) - p;
+            memcpy(&buf[idx], p, n); // copy the run up to the next tab in one go
+            idx += n;
+            if (tab) {
+                buf[idx++] = ' ';
+                while (idx % TAB_STOP != 0) buf[idx++] = ' ';
+            }
+        }
+    }
+    buf[idx] = '\0';
+    *rsize = idx;
+    return buf;
+}
+
+/**
+ * `editorRowMaterialize()`
+ * builds render and hl for a row when it is first drawn (or matched by find).
+ * Rows off screen don't keep them, see editorEvictRows().
+*/
+void editorRowMaterialize(erow *row) {
+    if (row->render) return;
+    row->render = editorRenderText(row, NULL, &row->rsize);
+    if (editorRowIndex(row) < E.hlfrontier) editorRowHighlight(row); // hl_open_comment is up to date for rows before E.hlfrontier
+    else editorRowUnhighlight(row); // plain until catching up gets here
+    rowLeafSetRendered(row->leaf);
+    E.nrendered++;
+}
+
+void editorRowEvict(erow *row) {
+    if (!row->render) return;
+    free(row->render);
+    free(row->hl);
+    row->render = NULL;
+    row->hl = NULL;
+    row->nhl = 0;
+    row->rsize = 0;
+    E.nrendered--;
+}
+
+/**
+ * `editorEvictRows()`
+ * drops render and hl of every materialized row outside the screen.
+ * Only the leaves on E.renderedleaves are looked at, so this costs about as much as the rows it has to go through.
+*/
+void editorEvictRows() {
+    if (E.nrendered <= E.screenrows) return; // only rows on screen are materialized
+
+    rownode *leaf, *next;
+    for (leaf = E.renderedleaves; leaf; leaf = next) {
+        next = leaf->rnext;
+        int keep = 0; // 1 if rows on screen stay materialized
+        int at = leaf->n > 0 ? editorRowIndex(&leaf->rows[0]) : 0;
+        for (int j = 0; j < leaf->n; j++) {
+            erow *row = &leaf->rows[j];
+            if (!row->render) continue;
+            if (at + j < E.rowoff || at + j >= E.rowoff + E.screenrows) editorRowEvict(row);
+            else keep = 1;
+        }
+        if (!keep) rowLeafClearRendered(leaf);
+    }
+}
+
+void editorUpdateRow(erow *row) {
+    if (row->render) row->render = editorRenderText(row, row->render, &row->rsize); // a row on screen stays materialized
+    editorUpdateSyntax(row);
+}
+
+/**
+ * `editorNewRow()`
+ * inserts a row that uses chars as is at index at, and returns it.
+ * Unlike editorInsertRowChars() it doesn't call editorUpdateRow() or touch E.dirty: a paste adds its rows with it and updates them all at once.
+*/
+erow *editorNewRow(int at, char *chars, size_t len, int owned) {
+    erow *row = rowTreeInsert(at); // open a slot for the new row in the row tree
+
+    editorHighlightJobEdit(at, 1);
+    if (at < E.hlfrontier || E.hlfrontier == E.numrows) E.hlfrontier++; // rows move down a line, but a new row at the frontier isn't known
+    if (at < E.hlpending) E.hlpending++;
+
+    row->size = len;
+    row->chars = chars;
+    row->gap = len; // the gap starts out empty, at the end of the row
+    row->gaplen = 0;
+    row->owned = owned;
+
+    row->rsize = 0;
+    row->render = NULL;
+    row->hl = NULL;
+    row->nhl = 0;
+    row->hl_open_comment = 0;
+    E.numrows++;
+    return row;
+}
+
+/**
+ * `editorInsertRowChars()`
+ * inserts a row that uses chars as is.
+ * owned says whether the row may free and edit chars (a malloc'd copy) or only borrows it from the original file buffer.
+*/
+void editorInsertRowChars(int at, char *chars, size_t len, int owned) {
+    if (at < 0 || at > E.numrows) return; // if at is out of bounds, return
+    editorUpdateRow(editorNewRow(at, chars, len, owned));
+    E.dirty++;
+}
+
+void editorInsertRow(int at, char *s, size_t len) {
+    if (at < 0 || at > E.numrows) return; // if at is out of bounds, return
+
+    char *chars = malloc(len + 1);
+    memcpy(chars, s, len);
+    chars[len] = '\0'; // null terminate string
+    editorInsertRowChars(at, chars, len, 1);
+}
+
+void editorFreeRow(erow *row) {
+    editorRowEvict(row);
+    if (row->owned) free(row->chars);
+}
+
+void editorDelRow(int at) {
+    if (at < 0 || at >= E.numrows) return; // if at is out of bounds, return
+    editorFreeRow(editorRowAt(at));
+    rowTreeDelete(at); // unlink the row from the row tree
+    E.numrows--;
+    E.dirty++;
+
+    editorHighlightJobEdit(at, -1);
+    if (at < E.hlfrontier) E.hlfrontier--;
+    if (at < E.hlpending) E.hlpending--;
+    if (at < E.numrows) editorUpdateSyntaxRows(editorRowAt(at), 0); // the row after it now follows another one
+}
+
+void editorRowInsertChar(erow *row, int at, int c) {
+    if (at < 0 || at > row->size) at = row->size; // if at is out of bounds, set it to the end of the row
+
+    editorRowReserve(row, 1); // grows the buffer only when the gap is used up
+    editorRowMoveGap(row, at); // free when the cursor hasn't moved since the last edit
+    row->chars[row->gap++] = c; // the new char takes the first byte of the gap
+    row->gaplen--;
+    row->size++;
+    editorUpdateRow(row);
+    E.dirty++;
+}
+
+void editorRowAppend(erow *row, const char *s, size_t len) { // appends s without rendering or highlighting the row
+    editorRowReserve(row, len);
+    editorRowMoveGap(row, row->size);
+    memcpy(&row->chars[row->gap], s, len); // copy string s to end of row
+    row->gap += len;
+    row->gaplen -= len;
+    row->size += len;
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len) {
+    editorRowAppend(row, s, len);
+    editorUpdateRow(row);
+    E.dirty++;
+}
+
+void editorRowDelChar(erow *row, int at) {
+    if (at < 0 || at >= row->size) return; // if at is out of bounds, return
+    editorRowMoveGap(row, at);
+    row->gaplen++; // the char right after the gap joins it
+    row->size--;
+    editorUpdateRow(row);
+    E.dirty++;
+}
+
+/*** editor operations ***/
+
+void editorInsertChar(int c) {
+    if (E.cy == E.numrows) { // if cursor is at the end of the file
+        editorInsertRow(E.numrows, "", 0); // append empty row
+    }
+    editorRowInsertChar(editorRowAt(E.cy), E.cx, c); // insert char at cursor position
+    E.cx++;
+}
+
+void editorInsertNewLine() {
+    if (E.cx == 0) {
+        editorInsertRow(E.cy, "", 0); // insert empty row at cursor position
+    } else {
+        erow *row = editorRowAt(E.cy);
+        editorRowMoveGap(row, E.cx); // the text after the cursor now sits contiguously right behind the gap
+        editorInsertRow(E.cy + 1, &row->chars[row->gap + row->gaplen], row->size - E.cx); // insert new row at cursor position
+        row = editorRowAt(E.cy); // update row pointer. editorInsertRow() may split the leaf holding the row, which moves rows around on us and invalidates the pointer (yikes)
+        row->gaplen += row->size - E.cx; // the moved text joins the gap
+        row->size = E.cx;
+        editorUpdateRow(row);
+    }
+    E.cy++;
+    E.cx = 0;
+}
+
+const char *lineEnd(const char *s, const char *end) { // returns the first '\r' or '\n' in [s, end), or end
+    while (s < end && *s != '\r' && *s != '\n') s++;
+    return s;
+}
+
+/**
+ * `editorInsertText()`
+ * inserts text at the cursor as if it was typed, but in one go: "\r", "\n" and "\r\n" each start a new line.
+ * Typed key by key, every character re-renders and re-highlights its row
+ * (and every opened or closed comment re-highlights the rest of the file).
+ * Here the rows are spliced in first, then highlighted once, in order.
+*/
+void editorInsertText(const char *s, size_t len) {
+    const char *end = s + len;
+    if (len == 0) return;
+    if (E.cy == E.numrows) editorInsertRow(E.numrows, "", 0); // if cursor is at the end of the file, append empty row
+
+    int first = E.cy;
+    erow *row = editorRowAt(first);
+    editorRowMoveGap(row, E.cx); // the text after the cursor, which goes after the pasted text, now sits right behind the gap
+    int taillen = row->size - E.cx;
+    char *tail = malloc(taillen + 1);
+    memcpy(tail, &row->chars[row->gap + row->gaplen], taillen);
+    row->gaplen += taillen; // cut the row at the cursor
+    row->size = E.cx;
+
+    const char *eol = lineEnd(s, end);
+    editorRowAppend(row, s, eol - s); // the first line goes after the cursor
+    E.cx += eol - s;
+    while (eol < end) {
+        s = eol + ((*eol == '\r' && eol + 1 < end && eol[1] == '\n') ? 2 : 1); // skip the line break
+        eol = lineEnd(s, end);
+
+        size_t linelen = eol - s;
+        size_t rowlen = linelen + (eol == end ? taillen : 0); // the last line gets the tail of the row we pasted into
+        char *chars = malloc(rowlen + 1);
+        memcpy(chars, s, linelen);
+        if (eol == end) memcpy(&chars[linelen], tail, taillen);
+        editorNewRow(++E.cy, chars, rowlen, 1);
+        E.cx = linelen;
+    }
+    if (E.cy == first) editorRowAppend(row, tail, taillen); // no line break: the tail goes back where it was
+    free(tail);
+
+    int y;
+    for (y = first, row = editorRowAt(first); y <= E.cy; y++, row = editorRowNext(row)) {
+        if (row->render) row->render = editorRenderText(row, row->render, &row->rsize); // a row on screen stays materialized
+    }
+    editorUpdateSyntaxRows(editorRowAt(first), E.cy - first + 1); // the rows after the paste only change if it opened or closed a comment
+    E.dirty++;
+}
+
+void editorDelChar() {
+    if (E.cy == E.numrows) return; // if cursor is at the end of the file
+    if (E.cx == 0 & E.cy == 0) return; // if cursor is at the beginning of the file
+
+    erow *row = editorRowAt(E.cy);
+    if (E.cx > 0) {
+        editorRowDelChar(row, E.cx - 1); // delete char to the left of the cursor
+        E.cx--;
+    } else {
+        erow *prev = editorRowAt(E.cy - 1);
+        E.cx = prev->size; // move cursor to the end of the previous line
+        editorRowAppendString(prev, editorRowChars(row), row->size); // append current line to previous line
+        editorDelRow(E.cy); // delete current line
+        E.cy--;
+    }
+}
+
+/*** file i/o ***/
+
+/**
+ * `rowLeafBytes()`
+ * returns the number of bytes the rows of leaf take up in a saved file.
+ * The rows of an unedited leaf lie back to back in E.orig: from where its first row starts to past the newline of its last one.
+*/
+size_t rowLeafBytes(rownode *leaf) {
+    if (leaf->n == 0) return 0;
+    if (!leaf->edited) return leaf->rows[leaf->n - 1].chars + leaf->rows[leaf->n - 1].size + 1 - leaf->rows[0].chars;
+
+    size_t len = 0;
+    for (int j = 0; j < leaf->n; j++) len += leaf->rows[j].size + 1; // add length of each row + 1 for newline character
+    return len;
+}
+
+size_t editorRowsLength() {
+    size_t totlen = 0;
+    for (rownode *leaf = rowTreeFirstLeaf(); leaf; leaf = leaf->next) totlen += rowLeafBytes(leaf);
+    return totlen;
+}
+
+/**
+ * `editorOrigLoad()`
+ * loads the file open on fd into E.orig, replacing whatever E.orig held without freeing it.
+*/
+void editorOrigLoad(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) die("fstat");
+    E.origdev = st.st_dev;
+    E.origino = st.st_ino;
+    E.origmapped = 0;
+    E.origfd = -1;
+
+    /**
+     * `mmap()`
+     * A regular file is mapped instead of read: rows point straight into the page cache,
+     * so opening copies nothing and pages of the file are only loaded once they are touched.
+     * We never write through the mapping (it is PROT_READ); a row copies its bytes on its first edit.
+     * It is MAP_SHARED so that it shows what editorSaveInPlace() writes to the file,
+     * which never overwrites bytes a row still borrows: a row is made to own its text before its bytes on disk change.
+     * The catch is that other programs can write to the file too. Reading the whole file, as we did before, was immune to that;
+     * a mapping shows their changes in rows we never touched, and reading past the end of a file they cut short raises SIGBUS.
+     * editorOrigCheck() looks out for that every time the editor wakes up.
+    */
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED) {
+            E.orig = map;
+            E.origlen = st.st_size;
+            E.origmaplen = st.st_size;
+            E.origmapped = 1;
+            E.origfd = dup(fd); // the caller closes fd
+            E.origstat = st;
+        }
+    }
+
+    /**
+     * Anything we can't map (empty files, pipes, ...) is read into E.orig at once and never modified afterwards.
+     * Rows only point into it, so opening costs one read plus one pass to find the newlines,
+     * instead of a getline() and a malloc per line.
+    */
+    if (!E.origmapped) {
+        size_t cap = st.st_size > 0 ? (size_t)st.st_size + 1 : 4096;
+        size_t len = 0;
+        char *buf = malloc(cap);
+        ssize_t nread;
+        while ((nread = read(fd, &buf[len], cap - len)) != 0) {
+            if (nread == -1) {
+                if (errno == EINTR) continue;
+                die("read");
+            }
+            len += nread;
+            if (len == cap) {
+                cap *= 2;
+                buf = realloc(buf, cap);
+            }
+        }
+        E.orig = buf;
+        E.origlen = len;
+        E.origmaplen = len;
+    }
+}
+
+/**
+ * `editorRebaseRows()`
+ * points the rows from row on, len bytes of them, at off in E.orig, which holds the same text now.
+ * They are unedited again, and so are the leaves they are in once every row is back in E.orig.
+*/
+void editorRebaseRows(erow *row, size_t off, size_t len) {
+    for (size_t end = off + len; off < end; row = editorRowNext(row)) {
+        if (row->owned) free(row->chars);
+        row->chars = E.orig + off;
+        row->gap = row->size; // a borrowed row has its (empty) gap at the end
+        row->gaplen = 0;
+        row->owned = 0;
+        off += row->size + 1;
+    }
+}
+
+/**
+ * `editorOrigReload()`
+ * makes the file just saved at path the new original buffer and points every row into it.
+ * The rows hold exactly the len bytes that were written, so edited rows give up their own copies and count as unedited again:
+ * the next save only has to write what changes after this one.
+*/
+void editorOrigReload(char *path, size_t len) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size != len) { // changed behind our back: keep the rows as they are
+        close(fd);
+        return;
+    }
+
+    char *old = E.orig;
+    size_t oldlen = E.origmaplen;
+    int oldmapped = E.origmapped;
+    int oldfd = E.origfd;
+    editorOrigLoad(fd);
+    close(fd);
+
+    editorRebaseRows(editorRowAt(0), 0, len);
+    for (rownode *leaf = rowTreeFirstLeaf(); leaf; leaf = leaf->next) leaf->edited = 0;
+    if (oldmapped) munmap(old, oldlen);
+    else free(old);
+    if (oldfd != -1) close(oldfd);
+}
+
+/**
+ * `writeAll()`
+ * writev()s every iovec, picking up where a partial write stopped.
+*/
+int writeAll(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) { // skip the iovecs that were written completely
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/**
+ * `saveJob`
+ * One save of the buffer: a snapshot of its text as iovecs, and how writing it out went.
+ * A job runs either right away or on a thread of its own while editing goes on (see editorSave()).
+*/
+struct saveJob {
+    char *path; // file being replaced
+    struct iovec *iov; // the text to write, newlines included
+    int iovcnt;
+    int iovcap;
+    char *copy; // copies of the edited rows, when the snapshot has to outlive them
+    size_t len; // bytes to write
+    int dirty; // E.dirty when the snapshot was taken
+    mode_t mode; // permissions of the saved file
+    int exists; // 1 if path is a file already,
+    uid_t uid; // and its owner
+    gid_t gid;
+    int overwrite; // set by editorSaveRun(): 1 if path has to be written over instead of replaced (see editorSaveOverwrite())
+    int err; // errno of the step that failed, 0 on success
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int done; // guarded by lock: 1 once the thread is finished with the job
+};
+
+void saveJobAdd(struct saveJob *job, char *s, size_t len) {
+    if (len == 0) return;
+    job->len += len;
+    if (job->iovcnt > 0) {
+        struct iovec *last = &job->iov[job->iovcnt - 1];
+        if ((char *)last->iov_base + last->iov_len == s) { // picks up where the last piece ends: grow it instead
+            last->iov_len += len;
+            return;
+        }
+    }
+    if (job->iovcnt == job->iovcap) {
+        job->iovcap = job->iovcap ? job->iovcap * 2 : 64;
+        job->iov = realloc(job->iov, job->iovcap * sizeof(struct iovec));
+    }
+    job->iov[job->iovcnt++] = (struct iovec){ s, len };
+}
+
+void saveJobAddRow(struct saveJob *job, erow *row) {
+    saveJobAdd(job, row->chars, row->gap); // text before the gap
+    saveJobAdd(job, &row->chars[row->gap + row->gaplen], row->size - row->gap); // text after the gap
+    saveJobAdd(job, "\n", 1);
+}
+
+size_t editorRowCopy(erow *row, char *buf) { // copies the row's text and a newline to buf, returns the number of bytes copied
+    memcpy(buf, row->chars, row->gap);
+    memcpy(&buf[row->gap], &row->chars[row->gap + row->gaplen], row->size - row->gap);
+    buf[row->size] = '\n';
+    return row->size + 1;
+}
+
+/**
+ * `editorSnapshotRows()`
+ * describes the whole buffer to job as a list of iovecs, without copying the original file.
+ * A row still borrowed from E.orig is taken together with the newline that follows it there,
+ * so a run of unedited lines collapses into one iovec.
+ * Edited rows are pointed at in place if copy is 0 (the job is written before the next edit),
+ * or copied into job->copy if copy is 1 (edits may move or free their buffers while the job runs).
+*/
+void editorSnapshotRows(struct saveJob *job, int copy) {
+    rownode *leaf;
+    char *p = NULL;
+    int j;
+
+    if (copy) {
+        size_t copylen = 0;
+        for (leaf = rowTreeFirstLeaf(); leaf; leaf = leaf->next) {
+            for (j = 0; leaf->edited && j < leaf->n; j++) {
+                if (leaf->rows[j].owned) copylen += leaf->rows[j].size + 1;
+            }
+        }
+        p = job->copy = malloc(copylen ? copylen : 1);
+    }
+
+    for (leaf = rowTreeFirstLeaf(); leaf; leaf = leaf->next) {
+        if (!leaf->edited) { // the whole leaf in one piece
+            if (leaf->n > 0) saveJobAdd(job, leaf->rows[0].chars, rowLeafBytes(leaf));
+            continue;
+        }
+        for (j = 0; j < leaf->n; j++) {
+            erow *row = &leaf->rows[j];
+            if (!row->owned) {
+                int nl = row->chars + row->size < E.orig + E.origlen && row->chars[row->size] == '\n'; // not a stripped "\r\n" or a last line without one
+                saveJobAdd(job, row->chars, row->size + nl);
+                if (!nl) saveJobAdd(job, "\n", 1);
+            } else if (copy) {
+                saveJobAdd(job, p, editorRowCopy(row, p));
+                p += row->size + 1;
+            } else {
+                saveJobAddRow(job, row);
+            }
+        }
+    }
+}
+
+int saveJobWrite(struct saveJob *job, int fd) {
+    for (int i = 0; i < job->iovcnt; i += SAVE_IOV_MAX) { // one writev() per SAVE_IOV_MAX iovecs
+        int n = job->iovcnt - i < SAVE_IOV_MAX ? job->iovcnt - i : SAVE_IOV_MAX;
+        if (writeAll(fd, &job->iov[i], n) == -1) return -1;
+    }
+    return 0;
+}
+
+/**
+ * `editorSaveRun()`
+ * writes job to a new file next to job->path, flushes it to disk and renames it over job->path.
+ * rename() swaps the files in one step, so a crash at any point leaves either the old file or the new one, never a mix of both.
+ * The old file lives on for as long as E.orig maps it, so rows borrowed from it stay valid.
+ * The new file gets the old one's permissions and owner, though not its ACLs or extended attributes.
+ * If the directory can't take a new file, or the new file can't have the old one's owner,
+ * job->overwrite asks editorSaveFinish() to write over the old file instead.
+ * Touches nothing but job, so it can run on its own thread.
 */
-int editorRowRxToCx(erow *row, int rx) {
-    int cur_rx = 0;
-    int cx;
-    for (cx = 0; cx < row->size; cx++) {
-        if (row->chars[cx] == '\t') cur_rx += (TAB_STOP - 1) - (cur_rx % TAB_STOP); // add number of spaces until next tab stop
-        cur_rx++;
+void *editorSaveRun(void *arg) {
+    struct saveJob *job = arg;
+    size_t tmplen = strlen(job->path) + sizeof(".tiny-XXXXXX");
+    char *tmp = malloc(tmplen);
+    snprintf(tmp, tmplen, "%s.tiny-XXXXXX", job->path);
+
+    int fd = mkstemp(tmp); // creates a file with a unique name in place of the X's, in the same directory so that rename() works
+    if (fd == -1) {
+        job->err = errno;
+        job->overwrite = job->exists && (errno == EACCES || errno == EROFS); // a file we can write in a directory we can't
+    } else {
+        if (job->exists && fchown(fd, job->uid, job->gid) == -1) { // before fchmod(), which it may undo setuid bits of
+            job->err = errno;
+            job->overwrite = 1;
+        } else if (fchmod(fd, job->mode) == -1 || saveJobWrite(job, fd) == -1 || fsync(fd) == -1) {
+            job->err = errno;
+        }
+        if (close(fd) == -1 && job->err == 0) job->err = errno;
+        if (job->err == 0 && rename(tmp, job->path) == -1) job->err = errno;
 
-        if (cur_rx > rx) return cx; // return index of character at cx
+        if (job->err != 0) {
+            unlink(tmp);
+        } else {
+            char *slash = strrchr(tmp, '/');
+            if (slash) slash[slash == tmp] = '\0'; // keep the directory part, "/" for files in the root
+            int dirfd = open(slash ? tmp : ".", O_RDONLY);
+            if (dirfd != -1) { // flush the directory too, or the rename itself may not survive a crash
+                fsync(dirfd);
+                close(dirfd);
+            }
+        }
     }
+    free(tmp);
 
-    return cx;
+    pthread_mutex_lock(&job->lock);
+    job->done = 1;
+    pthread_mutex_unlock(&job->lock);
+    editorWake(WAKE_SAVE);
+    return NULL;
 }
 
-void editorUpdateRow(erow *row) {
-    int j, tabs = 0;
-
-    for (j = 0; j < row->size; j++)
-        if (row->chars[j] == '\t') tabs++;
-
-    free(row->render);
-    row->render = malloc(row->size + tabs * (TAB_STOP - 1) + 1); // TAP_STOP spaces for each tab(1 space is already in the size of the row)
+/**
+ * `editorSaveOverwrite()`
+ * saves the buffer, len bytes, by writing it over path itself, for when editorSaveRun() can't put a new file in its place.
+ * Like editors without a writable directory have to, it gives up on atomic saves: a crash halfway leaves a cut off file.
+ * The file may be the one E.orig maps, so the buffer is first copied into a new E.orig of its own that the rows point into.
+ * Returns 0 on success, -1 with errno set if writing failed.
+*/
+int editorSaveOverwrite(char *path, size_t len) {
+    char *buf = malloc(len ? len : 1);
+    char *p = buf;
+    for (erow *row = editorRowAt(0); row; row = editorRowNext(row)) p += editorRowCopy(row, p);
+
+    editorOrigFree(); // rows still point into it, but are only pointed elsewhere from here on
+    E.orig = buf;
+    E.origlen = E.origmaplen = len;
+    editorRebaseRows(editorRowAt(0), 0, len);
+    for (rownode *leaf = rowTreeFirstLeaf(); leaf; leaf = leaf->next) leaf->edited = 0;
+
+    int fd = open(path, O_WRONLY | O_TRUNC);
+    if (fd == -1) return -1;
+    struct iovec iov = { buf, len };
+    int ret = writeAll(fd, &iov, 1) == -1 || fsync(fd) == -1 ? -1 : 0;
+    int err = errno; // close() must not hide why writing failed
+    if (close(fd) == -1 && ret == 0) return -1;
+    errno = err;
+    return ret;
+}
 
-    int idx = 0;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            row->render[idx++] = ' ';
-            while (idx % TAB_STOP != 0) row->render[idx++] = ' ';
-        } else row->render[idx++] = row->chars[j];
+void editorSaveFinish(struct saveJob *job) {
+    if (job->overwrite) { // what is in the buffer now, which may have been edited since the job started
+        size_t len = editorRowsLength();
+        job->err = editorSaveOverwrite(job->path, len) == 0 ? 0 : errno;
+        job->len = len;
+        job->dirty = E.dirty;
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
-
-    editorUpdateSyntax(row);
+    if (job->err == 0) {
+        if (E.dirty == job->dirty) editorOrigReload(job->path, job->len); // the buffer is what was just written: load it, so the next save can patch it
+        E.dirty -= job->dirty; // still dirty if the buffer was edited while the job ran
+        editorSetStatusMessage("%zu bytes written to disk", job->len);
+    } else {
+        editorSetStatusMessage("Can't save! I/O error: %s", strerror(job->err)); // strerror() returns a pointer to a string that describes the error code passed in the argument errnum
+    }
+    pthread_mutex_destroy(&job->lock);
+    free(job->path);
+    free(job->iov);
+    free(job->copy);
+    free(job);
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
-    if (at < 0 || at > E.numrows) return; // if at is out of bounds, return
+/**
+ * `editorSavePoll()`
+ * reports a background save that has finished. Returns 1 if there was one.
+*/
+int editorSavePoll() {
+    if (E.save == NULL) return 0;
+
+    pthread_mutex_lock(&E.save->lock);
+    int done = E.save->done;
+    pthread_mutex_unlock(&E.save->lock);
+    if (!done) return 0;
+
+    pthread_join(E.save->thread, NULL);
+    editorSaveFinish(E.save);
+    E.save = NULL;
+    return 1;
+}
 
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1)); // allocate memory for new row
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at)); // move rows after at to the right by 1 (memmove() is like memcpy() but it works even if the memory regions overlap
-    for (int j = at + 1; j <= E.numrows; j++) E.row[j].idx++; // increment idx of rows after at by 1
+/**
+ * `editorSaveWait()`
+ * blocks until a background save has finished, and reports it.
+*/
+void editorSaveWait() {
+    if (E.save == NULL) return;
 
-    E.row[at].idx = at;
+    pthread_join(E.save->thread, NULL);
+    editorSaveFinish(E.save);
+    E.save = NULL;
+}
 
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0'; // null terminate string
+/**
+ * `saveRegion`
+ * A run of rows that editorSaveInPlace() writes over the bytes at off.
+*/
+struct saveRegion {
+    size_t off;
+    size_t len;
+    erow *row; // first row of the run
+};
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    E.row[at].hl = NULL;
-    E.row[at].hl_open_comment = 0;
-    editorUpdateRow(&E.row[at]);
+int editorWriteRegion(int fd, struct saveRegion *region) {
+    struct saveJob job = { 0 }; // only for its list of iovecs
+    for (erow *row = region->row; job.len < region->len; row = editorRowNext(row)) saveJobAddRow(&job, row);
 
-    E.numrows++;
-    E.dirty++;
+    int ret = lseek(fd, region->off, SEEK_SET) == -1 ? -1 : saveJobWrite(&job, fd);
+    free(job.iov);
+    return ret;
 }
 
-void editorFreeRow(erow *row) {
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
-}
+/**
+ * `editorSaveInPlace()`
+ * saves len bytes by overwriting only what changed in the file E.orig was loaded from, instead of writing a new file.
+ * A row still borrowed from E.orig at the offset it is written to is on disk already, and so is a whole unedited leaf that starts there.
+ * Runs of other rows are written over the bytes they replace, which no row borrows.
+ *
+ * Unlike editorSaveRun() this is not atomic: a crash while it writes can leave some of the changed lines on disk and not others.
+ * To keep that to a few patched lines, it only saves when every line is where it was in the file
+ * (edits that kept the length of each line) and little is written; anything else is left to editorSaveRun().
+ * It also writes through the file itself, so other hard links to it see the change,
+ * where editorSaveRun() puts a new file in place of path and leaves them with the old one.
+ * Returns 0 without touching the file if it can't be patched like that, 1 once it has saved, and -1 with errno set if writing failed.
+*/
+int editorSaveInPlace(char *path, size_t len, size_t *written) {
+    struct stat st;
+    if (!E.origmapped || len != E.origlen || stat(path, &st) == -1 || st.st_dev != E.origdev || st.st_ino != E.origino || (size_t)st.st_size != E.origlen) return 0;
+
+    struct saveRegion *regions = NULL;
+    int nregions = 0;
+    int cap = 0;
+    struct saveRegion run = { 0, 0, NULL }; // edited rows since the last row that is on disk
+    size_t off = 0;
+    rownode *leaf;
+    int j;
 
-void editorDelRow(int at) {
-    if (at < 0 || at >= E.numrows) return; // if at is out of bounds, return
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1)); // move rows after at to the left by 1
-    for (int j = at; j < E.numrows; j++) E.row[j].idx--; // decrement idx of rows after at by 1
-    E.numrows--;
-    E.dirty++;
-}
+    for (leaf = rowTreeFirstLeaf(); leaf; leaf = leaf->next) {
+        if (leaf->n == 0) continue;
+        int skip = !leaf->edited && (size_t)(leaf->rows[0].chars - E.orig) == off; // the whole leaf is on disk
 
-void editorRowInsertChar(erow *row, int at, int c) {
-    if (at < 0 || at > row->size) at = row->size; // if at is out of bounds, set it to the end of the row
+        for (j = 0; j < leaf->n; j++) {
+            erow *row = &leaf->rows[j];
+            if (!row->owned && (size_t)(row->chars - E.orig) != off) { // an unedited row moved: lines were added, removed or resized before it
+                free(regions);
+                return 0;
+            }
+
+            int ondisk = skip || (!row->owned && row->chars + row->size < E.orig + E.origlen && row->chars[row->size] == '\n'); // not a stripped "\r\n" or a last line without one
+            if (!ondisk && run.row == NULL) {
+                run.off = off;
+                run.row = row;
+            } else if (ondisk && run.row != NULL) {
+                run.len = off - run.off;
+                if (nregions == cap) {
+                    cap = cap ? cap * 2 : 16;
+                    regions = realloc(regions, cap * sizeof(struct saveRegion));
+                }
+                regions[nregions++] = run;
+                run.row = NULL;
+            }
+            if (skip) break;
+            off += row->size + 1;
+        }
+        if (skip) off += rowLeafBytes(leaf);
+    }
+    if (run.row != NULL) { // the buffer ends on edited rows
+        run.len = off - run.off;
+        if (nregions == cap) regions = realloc(regions, (cap + 1) * sizeof(struct saveRegion));
+        regions[nregions++] = run;
+    }
+
+    size_t bytes = 0;
+    for (int i = 0; i < nregions; i++) bytes += regions[i].len;
+    if (bytes >= SAVE_BACKGROUND_MIN || bytes > E.origlen / 2) { // about as cheap to write the whole file, and safer
+        free(regions);
+        return 0;
+    }
 
-    row->chars = realloc(row->chars, row->size + 2); // allocate memory for new char. add 2 because we also have to make room for the null byte
     /**
-     * `memmove()`
-     * memmove() copies n bytes from memory area src to memory area dest.
-     * The memory areas may overlap: copying takes place as though the bytes in src are first copied into a temporary array that does not overlap src or dest, 
-     * and the bytes are then copied from the temporary array to dest.
+     * Another program may have written to the file since the editor last woke up. The rows would no longer match it,
+     * and patching it would splice our lines into theirs: so check once more, on the file just opened, right before writing.
     */
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1); // move chars after at to the right by 1
-    row->size++;
-    row->chars[at] = c;
-    editorUpdateRow(row);
-    E.dirty++;
+    int ret = 1;
+    int fd = open(path, O_WRONLY);
+    if (fd == -1) ret = -1;
+    else if (fstat(fd, &st) == -1 || st.st_dev != E.origdev || st.st_ino != E.origino || editorOrigCheck()) {
+        close(fd);
+        free(regions);
+        return 0; // left to editorSaveRun(), with the rows as editorOrigCheck() left them
+    }
+    for (int i = 0; i < nregions && ret == 1; i++) {
+        if (editorWriteRegion(fd, &regions[i]) == -1) ret = -1;
+    }
+    if (ret == 1 && fsync(fd) == -1) ret = -1;
+    if (fd != -1) {
+        int err = errno; // close() must not hide why writing failed
+        close(fd);
+        errno = err;
+    }
+
+    if (ret == 1) { // the file now holds the buffer, so the rows just written can go back to borrowing their text from it
+        for (int i = 0; i < nregions; i++) editorRebaseRows(regions[i].row, regions[i].off, regions[i].len);
+        for (leaf = rowTreeFirstLeaf(); leaf; leaf = leaf->next) leaf->edited = 0;
+        if (fstat(E.origfd, &st) == 0) E.origstat = st; // our own change, not someone else's
+    }
+
+    free(regions);
+    *written = bytes;
+    return ret;
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-    row->chars = realloc(row->chars, row->size + len + 1); // allocate memory for new string including null byte
-    memcpy(&row->chars[row->size], s, len); // copy string s to end of row
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.dirty++;
+void editorOrigFree() {
+    if (E.origmapped) munmap(E.orig, E.origmaplen);
+    else free(E.orig);
+    if (E.origfd != -1) close(E.origfd);
+    E.origfd = -1;
+    E.orig = NULL;
+    E.origlen = 0;
+    E.origmaplen = 0;
+    E.origmapped = 0;
 }
 
-void editorRowDelChar(erow *row, int at) {
-    if (at < 0 || at >= row->size) return; // if at is out of bounds, return
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at); // move chars after at to the left by 1
-    row->size--;
-    editorUpdateRow(row);
+/**
+ * `editorOrigCheck()`
+ * makes every row own its text if another program changed the file E.orig maps since we loaded or wrote it
+ * (its inode, size, or modification or status change time, to the nanosecond, is not what we left it at), and lets go of the mapping.
+ * Rows get what they have in the file now; rows past a new, shorter end come up empty instead of raising SIGBUS.
+ * Text a program rewrote in place can't be had back, but edits are never lost, and the buffer counts as modified.
+ * A change between this check and the next time a row is touched, or while a background save runs, still gets through.
+ * Returns 1 if the file had changed.
+*/
+int editorOrigCheck() {
+    struct stat st;
+    if (!E.origmapped || fstat(E.origfd, &st) == -1) return 0;
+    if (st.st_ino == E.origstat.st_ino && st.st_size == E.origstat.st_size
+        && st.st_mtim.tv_sec == E.origstat.st_mtim.tv_sec && st.st_mtim.tv_nsec == E.origstat.st_mtim.tv_nsec
+        && st.st_ctim.tv_sec == E.origstat.st_ctim.tv_sec && st.st_ctim.tv_nsec == E.origstat.st_ctim.tv_nsec) return 0;
+
+    if (E.save) { // its snapshot points into the mapping. Once it is done, the file it wrote may be the one mapped
+        editorSaveWait();
+        return editorOrigCheck();
+    }
+    char *end = E.orig + ((size_t)st.st_size < E.origlen ? (size_t)st.st_size : E.origlen); // what can still be read
+    for (erow *row = editorRowAt(0); row; row = editorRowNext(row)) {
+        if (row->owned) continue;
+        if (row->chars + row->size > end) row->size = row->gap = row->chars < end ? end - row->chars : 0;
+        editorRowOwn(row);
+        editorRowEvict(row); // rendered from the old text
+    }
+    editorOrigFree();
+    editorSelectSyntaxHighlight(); // everything is highlighted again
     E.dirty++;
+    editorSetStatusMessage("Warning! %.20s was changed by another program", E.filename);
+    return 1;
 }
 
-/*** editor operations ***/
+/**
+ * `loadChunk`
+ * A part of the original file buffer that one thread turns into rows.
+ * A chunk owns every line that starts in [start, end), even if the line runs past end.
+*/
+struct loadChunk {
+    char *start;
+    char *end;
+    rownode **leaves; // leaves filled with the chunk's rows, in order
+    int nleaves;
+    int nrows;
+};
 
-void editorInsertChar(int c) {
-    if (E.cy == E.numrows) { // if cursor is at the end of the file
-        editorInsertRow(E.numrows, "", 0); // append empty row
-    }
-    editorRowInsertChar(&E.row[E.cy], E.cx, c); // insert char at cursor position
-    E.cx++;
-}
+void loadChunkAddRow(struct loadChunk *chunk, char *s, size_t len) {
+    while (len > 0 && s[len - 1] == '\r') len--; // remove trailing carriage returns; the newline is already left out
 
-void editorInsertNewLine() {
-    if (E.cx == 0) {
-        editorInsertRow(E.cy, "", 0); // insert empty row at cursor position
-    } else {
-        erow *row = &E.row[E.cy];
-        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx); // insert new row at cursor position
-        row = &E.row[E.cy]; // update row pointer. editorInsertRow() calls realloc(), which might move memory around on us and invalidate the pointer (yikes)
-        row->size = E.cx;
-        row->chars[row->size] = '\0'; // null terminate string
-        editorUpdateRow(row);
+    rownode *leaf = chunk->nleaves ? chunk->leaves[chunk->nleaves - 1] : NULL;
+    if (leaf == NULL || leaf->n == ROW_NODE_MAX - 1) { // a node is split once it is full, so stay one short of that
+        leaf = rowNodeNew(1);
+        chunk->leaves = realloc(chunk->leaves, sizeof(rownode *) * (chunk->nleaves + 1));
+        chunk->leaves[chunk->nleaves++] = leaf;
     }
-    E.cy++;
-    E.cx = 0;
-}
 
-void editorDelChar() {
-    if (E.cy == E.numrows) return; // if cursor is at the end of the file
-    if (E.cx == 0 & E.cy == 0) return; // if cursor is at the beginning of the file
+    erow *row = &leaf->rows[leaf->n++];
+    leaf->count++;
+    row->leaf = leaf;
+    row->size = len;
+    row->chars = s; // the row borrows its text from E.orig
+    if (s + len == E.orig + E.origlen || s[len] != '\n') leaf->edited = 1; // a "\r\n" line, or the last line without a newline: saving changes it
+    row->gap = len;
+    row->gaplen = 0;
+    row->owned = 0;
+    row->rsize = 0;
+    row->render = NULL;
+    row->hl = NULL;
+    row->nhl = 0;
+    row->hl_open_comment = 0;
+    chunk->nrows++;
+}
 
-    erow *row = &E.row[E.cy];
-    if (E.cx > 0) {
-        editorRowDelChar(row, E.cx - 1); // delete char to the left of the cursor
-        E.cx--;
-    } else {
-        E.cx = E.row[E.cy - 1].size; // move cursor to the end of the previous line
-        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size); // append current line to previous line
-        editorDelRow(E.cy); // delete current line
-        E.cy--;
+/**
+ * `editorLoadChunk()`
+ * finds the newlines of a chunk and fills leaves with its rows. Runs on a worker thread.
+ * With SSE2 it compares 16 bytes against '\n' at once and walks the bits of the resulting mask,
+ * so short lines don't pay for a memchr() call each.
+*/
+void *editorLoadChunk(void *arg) {
+    struct loadChunk *chunk = arg;
+    char *end = E.orig + E.origlen;
+    char *line = chunk->start; // start of the current line
+    char *p, *eol;
+
+    if (line > E.orig && line[-1] != '\n') { // the line we start in belongs to the previous chunk
+        eol = memchr(line, '\n', end - line);
+        line = eol ? eol + 1 : end;
+    }
+    if (line >= chunk->end) return NULL;
+
+    p = line;
+#ifdef __SSE2__
+    __m128i nl = _mm_set1_epi8('\n');
+    for (; end - p >= 16; p += 16) {
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), nl)); // bit i is set if p[i] is '\n'
+        while (mask) {
+            eol = p + __builtin_ctz(mask); // lowest set bit: the next newline
+            loadChunkAddRow(chunk, line, eol - line);
+            line = eol + 1;
+            if (line >= chunk->end) return NULL;
+            mask &= mask - 1; // clear the lowest set bit
+        }
+    }
+#endif
+    while ((eol = memchr(p, '\n', end - p)) != NULL) {
+        loadChunkAddRow(chunk, line, eol - line);
+        line = p = eol + 1;
+        if (line >= chunk->end) return NULL;
     }
+    if (line < end) loadChunkAddRow(chunk, line, end - line); // last line without a newline
+    return NULL;
 }
 
-/*** file i/o ***/
+/**
+ * `editorLoadRows()`
+ * turns the original file buffer into rows.
+ * Big files are split into chunks that are indexed in parallel, one thread per chunk;
+ * the calling thread takes the first chunk itself.
+ * The leaves of every chunk are then chained in order and the tree is built on top of them in one pass.
+*/
+void editorLoadRows() {
+    struct loadChunk chunks[LOAD_THREADS_MAX];
+    pthread_t threads[LOAD_THREADS_MAX];
+    int started[LOAD_THREADS_MAX];
+    int nchunks = 1;
+    int i, j;
+
+    if (E.origlen >= 2 * LOAD_CHUNK_MIN) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN); // number of online CPUs
+        size_t most = E.origlen / LOAD_CHUNK_MIN;
+        nchunks = ncpu < 1 ? 1 : ncpu;
+        if (nchunks > LOAD_THREADS_MAX) nchunks = LOAD_THREADS_MAX;
+        if ((size_t)nchunks > most) nchunks = most;
+    }
 
-char *editorRowsToString(int *buflen) {
-    int totlen = 0;
-    int j;
-    for (j = 0; j < E.numrows; j++) totlen += E.row[j].size + 1; // add length of each row + 1 for newline character
-    *buflen = totlen;
+    for (i = 0; i < nchunks; i++) {
+        chunks[i].start = E.orig + E.origlen * i / nchunks;
+        chunks[i].end = E.orig + E.origlen * (i + 1) / nchunks;
+        chunks[i].leaves = NULL;
+        chunks[i].nleaves = 0;
+        chunks[i].nrows = 0;
+    }
+    for (i = 1; i < nchunks; i++) started[i] = pthread_create(&threads[i], NULL, editorLoadChunk, &chunks[i]) == 0;
+    editorLoadChunk(&chunks[0]);
+    for (i = 1; i < nchunks; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+        else editorLoadChunk(&chunks[i]); // no thread for it; do it here
+    }
 
-    char *buf = malloc(totlen);
-    char *p = buf; // pointer to buf
-    for (j = 0; j < E.numrows; j++) { // copy each row to buf
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size; // move pointer to end of row
-        *p = '\n'; // add newline character
-        p++;
+    int nleaves = 0;
+    int nrows = 0;
+    for (i = 0; i < nchunks; i++) {
+        nleaves += chunks[i].nleaves;
+        nrows += chunks[i].nrows;
+    }
+    if (nleaves == 0) return; // an empty file keeps the empty tree
+
+    rownode **leaves = malloc(sizeof(rownode *) * nleaves);
+    int n = 0;
+    for (i = 0; i < nchunks; i++) {
+        for (j = 0; j < chunks[i].nleaves; j++) {
+            rownode *leaf = chunks[i].leaves[j];
+            leaf->prev = n ? leaves[n - 1] : NULL;
+            if (n) leaves[n - 1]->next = leaf;
+            leaves[n++] = leaf;
+        }
+        free(chunks[i].leaves);
     }
 
-    return buf;
+    rowNodeFree(E.rowroot); // the empty leaf of a fresh editor
+    E.rowroot = rowTreeBuild(leaves, nleaves);
+    E.numrows = nrows;
+    free(leaves);
 }
 
 void editorOpen(char *filename) {
     free(E.filename);
     E.filename = strdup(filename); // strdup() returns a pointer to a new string which is a duplicate of the string s.
 
-    editorSelectSyntaxHighlight();
+    int fd = open(filename, O_RDONLY); // open file in read only mode
+    if (fd == -1) die("open");
 
-    FILE *fp = fopen(filename, "r"); // open file in read mode
-    if (!fp) die("fopen");
-
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
+    editorOrigFree();
+    editorOrigLoad(fd);
+    close(fd); // the mapping stays valid after the file is closed
 
-    /**
-     * `getline()`
-     * getline() reads an entire line from stream,
-     * storing the address of the buffer containing the text into *lineptr.
-    */
-   while((linelen = getline(&line, &linecap, fp)) != -1) { // read line from file. returns -1 at the end of file
-       while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) linelen--; // remove trailing newline characters
-       editorInsertRow(E.numrows, line, linelen);
-   }
-    free(line);
-    fclose(fp);
+    editorLoadRows();
+    editorSelectSyntaxHighlight(); // once every row is there. Rows are highlighted as they come on screen, the rest when idle
     E.dirty = 0;
 }
 
 void editorSave() {
+    if (E.save) {
+        editorSetStatusMessage("Still saving, try again in a moment");
+        return;
+    }
+
     if (E.filename == NULL) {
         E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL); // prompt user for filename
         if (E.filename == NULL) {
@@ -808,45 +2853,56 @@ void editorSave() {
         editorSelectSyntaxHighlight();
     }
 
-    int len;
-    char *buf = editorRowsToString(&len);
+    char *path = realpath(E.filename, NULL); // through symlinks, so that the link survives the rename
+    if (path == NULL) path = strdup(E.filename); // a new file
+
+    size_t len = editorRowsLength();
+    size_t written;
+    int inplace = editorSaveInPlace(path, len, &written);
+    if (inplace != 0) {
+        if (inplace == 1) {
+            E.dirty = 0;
+            editorSetStatusMessage("%zu bytes written to disk", written);
+        } else {
+            editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+        }
+        free(path);
+        return;
+    }
+    len = editorRowsLength(); // editorSaveInPlace() may have found the file changed, and cut short the rows past its new end
+
+    struct saveJob *job = calloc(1, sizeof(struct saveJob));
+    job->path = path;
+
+    struct stat st;
+    if (stat(job->path, &st) == 0) {
+        job->mode = st.st_mode & 07777; // keep the permissions of the file we replace,
+        job->exists = 1;
+        job->uid = st.st_uid; // and its owner
+        job->gid = st.st_gid;
+    } else {
+        mode_t mask = umask(0); // umask() can only be read by setting it
+        umask(mask);
+        job->mode = 0644 & ~mask; // what open(..., O_CREAT, 0644) would have given a new file
+    }
+    job->dirty = E.dirty;
+    pthread_mutex_init(&job->lock, NULL);
 
     /**
-     * `O_RDWR`
-     * Open the file so that it can be read from and written to.
-     * 
-     * `O_CREAT`
-     * If the file does not exist it will be created.
-     * 
-     * `O_TRUNC`
-     * If the file already exists and is a regular file and the access mode allows writing (i.e., is O_RDWR or O_WRONLY) it will be truncated to length 0.
-     * 
-     * `0644`
-     * The mode specifies both the permissions to use if a new file is created and the permissions for the file if it already exists.
-     * It gives the owner of the file permission to read and write the file,
-     * and everyone else only gets permission to read the file.
+     * Large buffers are written on a thread of their own, so Ctrl-S returns at once.
+     * Their snapshot copies the edited rows, but still only points at the unedited ones:
+     * the bytes they borrow from E.orig stay as they are, as no in-place save can start before this one is done.
     */
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644); // open file in read/write mode. create file if it doesn't exist
-    if (fd != -1) {
-        if (ftruncate(fd, len) != -1) { // truncate file to a specified length
-            /**
-             * `ftruncate()`
-             * If the file previously was larger than this size, the extra data is lost.
-             * If the file previously was shorter, it is extended, and the extended part reads as null bytes ('\0').
-            */
-            if (write(fd, buf, len) == len) { // write buf to file
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-                editorSetStatusMessage("%d bytes written to disk", len);
-                return;
-            }
-        }
-        close(fd);
+    int background = len >= SAVE_BACKGROUND_MIN;
+    editorSnapshotRows(job, background);
+    if (background && pthread_create(&job->thread, NULL, editorSaveRun, job) == 0) {
+        E.save = job;
+        editorSetStatusMessage("Saving %zu bytes in the background...", job->len);
+        return;
     }
 
-    free(buf);
-    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno)); // strerror() returns a pointer to a string that describes the error code passed in the argument errnum
+    editorSaveRun(job);
+    editorSaveFinish(job);
 }
 
 /*** find ***/
@@ -855,14 +2911,9 @@ void editorFindCallback(char *query, int key) {
     static int last_match = -1;
     static int direction = 1; // 1 for forward, -1 for backward
 
-    static int saved_hl_line;
-    static char *saved_hl = NULL;
+    static char *scratch = NULL; // render of a row that isn't materialized
 
-    if (saved_hl) {
-        memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize); // restore saved highlight
-        free(saved_hl);
-        saved_hl = NULL;
-    }
+    E.matchrow = -1; // the last match, if any, is drawn in its own colors again
 
     if (key == '\r' || key == '\x1b') { // if enter or escape is pressed
         last_match = -1;
@@ -885,24 +2936,26 @@ void editorFindCallback(char *query, int key) {
         if (current == -1) current = E.numrows - 1; // wrap around to bottom of file
         else if (current == E.numrows) current = 0; // wrap around to top of file
 
-        erow *row = &E.row[current];
-        char *match = strstr(row->render, query); // strstr() returns a pointer to the first occurrence of query in row->render, or NULL if no match is found
+        erow *row = editorRowAt(current);
+        char *render = row->render;
+        int rsize;
+        if (!render) render = scratch = editorRenderText(row, scratch, &rsize); // search rows off screen without materializing them
+        char *match = strstr(render, query); // strstr() returns a pointer to the first occurrence of query in render, or NULL if no match is found
         if (match) {
-            last_match = current;
-            E.cy = current;
             /**
-             * match - row->render?
-             * match도 pointer고 row->render도 pointer라서 빼면 그 사이의 거리가 나온다.
+             * match - render?
+             * match도 pointer고 render도 pointer라서 빼면 그 사이의 거리가 나온다.
              * 그 거리가 cursor position이다.
             */
-            E.cx = editorRowRxToCx(row, match - row->render); // set cursor position to beginning of match
+            int at = match - render;
+            last_match = current;
+            E.cy = current;
+            E.cx = editorRowRxToCx(row, at); // set cursor position to beginning of match
             E.rowoff = E.numrows; // scroll to bottom of file
 
-            saved_hl_line = current;
-            saved_hl = malloc(row->rsize); // allocate memory for saved highlight
-            memcpy(saved_hl, row->hl, row->rsize); // save current highlight
-
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query)); // highlight match
+            E.matchrow = current; // drawn over the row's highlight, which stays as it is
+            E.matchcol = at;
+            E.matchlen = strlen(query);
             break;
         }
     }
@@ -928,14 +2981,24 @@ void editorFind() {
 
 /*** append buffer ***/
 
+/**
+ * `abuf`
+ * A buffer that a frame is built up in before it is written out in one go.
+ * It is meant to be kept and reused: abReset() empties it but keeps its memory,
+ * so once it has grown to the size of a frame, drawing one allocates nothing.
+*/
 struct abuf {
     char *b;
     int len;
+    int cap; // bytes allocated at b
 };
 
-#define ABUF_INIT {NULL, 0} // initialize abuf struct
+#define ABUF_INIT {NULL, 0, 0} // initialize abuf struct
+
+void abGrow(struct abuf *ab, int len) { // make room for len more bytes
+    int cap = ab->cap ? ab->cap : 4096;
+    while (cap < ab->len + len) cap *= 2; // double, so appending n bytes costs O(log n) reallocs in all
 
-void abAppend(struct abuf *ab, const char *s, int len) {
     /**
      * `realloc()`
      * The realloc() function changes the size of the memory block pointed to by ptr to size bytes.
@@ -943,16 +3006,26 @@ void abAppend(struct abuf *ab, const char *s, int len) {
      * or it will take care of free()ing the current block of memory
      * and allocating a new block of memory somewhere else that is big enough for our new string.
     */
-    char *new = realloc(ab->b, ab->len + len); // allocate memory for new string
+    char *new = realloc(ab->b, cap);
+    if (new == NULL) die("realloc");
+    ab->b = new;
+    ab->cap = cap;
+}
 
-    if (new == NULL) return; // return if realloc fails
-    memcpy(&new[ab->len], s, len); // copy string s to end of new string
-    ab->b = new; // assign new string to abuf struct
+void abAppend(struct abuf *ab, const char *s, int len) {
+    if (ab->len + len > ab->cap) abGrow(ab, len);
+    memcpy(&ab->b[ab->len], s, len); // copy string s to end of the buffer
     ab->len += len; // update length of abuf struct
 }
 
-void abFree(struct abuf *ab) {
-    free(ab->b);
+char *abExtend(struct abuf *ab, int len) { // append len bytes for the caller to fill in, and return where they start
+    if (ab->len + len > ab->cap) abGrow(ab, len);
+    ab->len += len;
+    return &ab->b[ab->len - len];
+}
+
+void abReset(struct abuf *ab) { // empty the buffer for the next frame, keeping its memory
+    ab->len = 0;
 }
 
 /*** output ***/
@@ -960,7 +3033,7 @@ void abFree(struct abuf *ab) {
 void editorScroll() {
     E.rx = 0;
     if(E.cy < E.numrows) {
-        E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+        E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
     }
 
     if (E.cy < E.rowoff) { // scroll up
@@ -977,9 +3050,69 @@ void editorScroll() {
     }
 }
 
-void editorDrawRows(struct abuf *ab) { // draw each row of the buffer to the screen
+/**
+ * What a cell attribute looks like on the terminal is worked out once, in editorInitAttrs(), instead of for every character:
+ * hlattr[hl] is the attribute of text highlighted as hl,
+ * sgr[attr] switches the terminal to attr from any other attribute (it resets everything first),
+ * and sgrcolor[attr] only sets the foreground color, for when reverse video is off before and after.
+*/
+struct sgrseq {
+    char s[12];
+    int len;
+};
+
+unsigned char hlattr[256];
+struct sgrseq sgr[256];
+struct sgrseq sgrcolor[256];
+
+void editorInitAttrs() {
+    int i;
+    for (i = 0; i < 256; i++) hlattr[i] = i == HL_NORMAL ? ATTR_PLAIN : editorSyntaxToColor(i);
+    for (i = 0; i < 256; i++) {
+        int fg = i & ~ATTR_INVERSE;
+        char color[8] = "";
+        if (fg != ATTR_PLAIN) snprintf(color, sizeof(color), ";%d", fg);
+        sgr[i].len = snprintf(sgr[i].s, sizeof(sgr[i].s), "\x1b[0%s%sm", (i & ATTR_INVERSE) ? ";7" : "", color); // reset, then reverse video and color
+        sgrcolor[i].len = snprintf(sgrcolor[i].s, sizeof(sgrcolor[i].s), "\x1b[%dm", fg); // set color
+    }
+}
+
+/**
+ * Drawing doesn't write escape sequences straight away.
+ * A frame is drawn into E.frame, a cell (character + attributes) per screen position,
+ * and editorFlushFrame() sends the terminal only the cells that differ from E.shown, what it shows already.
+ * Typing a character then costs a few bytes instead of a repaint of the whole screen.
+*/
+void editorFrameResize() {
+    int rows = E.screenrows + 2; // the status bar and the message bar go under the text
+    if (E.frame && rows == E.framerows && E.screencols == E.framecols) return;
+
+    free(E.frame);
+    free(E.shown);
+    E.framerows = rows;
+    E.framecols = E.screencols;
+    E.frame = malloc(sizeof(cell) * rows * E.screencols);
+    E.shown = NULL; // nothing known about the terminal: the next flush draws everything
+}
+
+cell *frameLine(int y) { // returns line y of the frame, cleared to blanks
+    cell *line = &E.frame[y * E.framecols];
+    for (int x = 0; x < E.framecols; x++) line[x] = (cell){ ' ', ATTR_PLAIN };
+    return line;
+}
+
+int framePuts(cell *line, int x, const char *s, int len, unsigned char attr) { // returns the column after s, which is cut at the edge of the screen
+    for (int i = 0; i < len && x < E.framecols; i++, x++) line[x] = (cell){ s[i], attr };
+    return x;
+}
+
+void editorDrawRows() { // draw each row of the buffer into the frame
+    static unsigned char *hl = NULL; // highlight of the columns on screen of a row, expanded from its spans
     int y;
+
+    hl = realloc(hl, E.screencols + 1);
     for (y = 0; y < E.screenrows; y++) {
+        cell *line = frameLine(y);
         int filerow = y + E.rowoff;
         if (filerow >= E.numrows) {
             if (E.numrows == 0 && y == E.screenrows / 3) {
@@ -992,72 +3125,48 @@ void editorDrawRows(struct abuf *ab) { // draw each row of the buffer to the scr
                 );
                 if (welcomelen > E.screencols) welcomelen = E.screencols; // truncate welcome message if it is too long
                 int padding = (E.screencols - welcomelen) / 2; // center welcome message
-                if (padding) {
-                    abAppend(ab, "~", 1);
-                    padding--;
-                }
-                while (padding--) abAppend(ab, " ", 1);
-                abAppend(ab, welcome, welcomelen);
+                if (padding) framePuts(line, 0, "~", 1, ATTR_PLAIN);
+                framePuts(line, padding, welcome, welcomelen, ATTR_PLAIN);
             } else {
-                abAppend(ab, "~", 1);
+                framePuts(line, 0, "~", 1, ATTR_PLAIN);
             }
         } else {
-            int len = E.row[filerow].rsize - E.coloff;
+            erow *row = editorRowAt(filerow);
+            editorRowMaterialize(row); // render and hl are only built for rows that are drawn
+            int len = row->rsize - E.coloff;
             if (len < 0) len = 0; // truncate row if it is too short
             if (len > E.screencols) len = E.screencols; // truncate row if it is too long
-            char *c = &E.row[filerow].render[E.coloff];
-            unsigned char *hl = &E.row[filerow].hl[E.coloff];
-            int current_color = -1;
-            int j;
-            for (j = 0; j < len; j++) {
+            char *c = &row->render[E.coloff];
+            editorRowExpandHl(row, E.coloff, len, hl);
+            if (filerow == E.matchrow) {
+                int from = E.matchcol > E.coloff ? E.matchcol : E.coloff;
+                int to = E.matchcol + E.matchlen < E.coloff + len ? E.matchcol + E.matchlen : E.coloff + len;
+                if (from < to) memset(&hl[from - E.coloff], HL_MATCH, to - from); // the find match
+            }
+            int current_color = ATTR_PLAIN;
+            int j = 0;
+            while (j < len) {
                 if (iscntrl(c[j])) {
                     /**
                      * Why '@'?
                      * In ASCII, the capital letters of the alphabet come after the @ character
                     */
                     char sym = (c[j] <= 26) ? '@' + c[j] : '?'; // replace non-printable characters with '?'
-                    abAppend(ab, "\x1b[7m", 4); // invert colors (7; Reverse Video)
-                    abAppend(ab, &sym, 1);
-                    abAppend(ab, "\x1b[m", 3); // reset colors (m; Turn Off Character Attributes)
-                    if (current_color != -1) {
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color); // set color
-                        abAppend(ab, buf, clen);
-                    }
-                } else if (hl[j] == HL_NORMAL) {
-                    if (current_color != -1) {
-                        abAppend(ab, "\x1b[39m", 5); // reset color
-                        current_color = -1;
-                    }
-                    abAppend(ab, &c[j], 1);
-                } else {
-                    int color = editorSyntaxToColor(hl[j]);
-                    if (color != current_color) {
-                        current_color = color;
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color); // set color
-                        abAppend(ab, buf, clen);
-                    }
-                    abAppend(ab, &c[j], 1);
+                    line[j] = (cell){ sym, ATTR_INVERSE | current_color }; // inverted, in the color of the text before it
+                    j++;
+                    continue;
                 }
+
+                unsigned char h = hl[j];
+                current_color = hlattr[h]; // looked up once for the whole run of equally highlighted text
+                for (; j < len && hl[j] == h && !iscntrl(c[j]); j++) line[j] = (cell){ c[j], current_color };
             }
-            abAppend(ab, "\x1b[39m", 5); // reset color
         }
-
-        /**
-         * `\x1b[K`
-         * The escape sequence \x1b[K is a VT100 escape sequence that erases the current line the cursor is on.
-         * 2 erases the whole line.
-         * 1 erases from the start of the line to the cursor.
-         * 0(default) erases from the cursor to the end of the line.
-        */
-        abAppend(ab, "\x1b[K", 3); // clear line (K; Erase In Line)
-        abAppend(ab, "\r\n", 2);
     }
 }
 
-void editorDrawStatusBar(struct abuf *ab) {
-    abAppend(ab, "\x1b[7m", 4); // invert colors (7; Reverse Video)
+void editorDrawStatusBar() {
+    cell *line = frameLine(E.screenrows);
     char status[80], rstatus[80];
     int len = snprintf(status, sizeof(status), "%.20s - %d lines",
         E.filename ? E.filename : "[No Name]", E.numrows,
@@ -1066,26 +3175,152 @@ void editorDrawStatusBar(struct abuf *ab) {
     int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d", 
         E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows); // current row and total number of rows and filetype
     if (len > E.screencols) len = E.screencols; // truncate status message if it is too long
-    abAppend(ab, status, len);
 
-    while (len < E.screencols) {
-        if (E.screencols - len == rlen) {
-            abAppend(ab, rstatus, rlen);
-            break;
-        } else {
-            abAppend(ab, " ", 1);
-            len++;
-        }
-    }
-    abAppend(ab, "\x1b[m", 3); // reset colors (m; Turn Off Character Attributes)
-    abAppend(ab, "\r\n", 2);
+    for (int x = 0; x < E.screencols; x++) line[x].attr = ATTR_INVERSE | ATTR_PLAIN; // the whole bar is in reverse video
+    framePuts(line, 0, status, len, ATTR_INVERSE | ATTR_PLAIN);
+    if (E.screencols - len >= rlen) framePuts(line, E.screencols - rlen, rstatus, rlen, ATTR_INVERSE | ATTR_PLAIN); // right aligned, if it fits
 }
 
-void editorDrawMessageBar(struct abuf *ab) {
-    abAppend(ab, "\x1b[K", 3); // clear line (K; Erase In Line)
+void editorDrawMessageBar() {
+    cell *line = frameLine(E.screenrows + 1);
     int msglen = strlen(E.statusmsg);
     if (msglen > E.screencols) msglen = E.screencols; // truncate message if it is too long
-    if (msglen && time(NULL) - E.statusmsg_time < 5) abAppend(ab, E.statusmsg, msglen); // display message for 5 seconds
+    if (msglen && (E.statusmsg_time == -1 || monotonicMillis() - E.statusmsg_time < STATUS_MSG_MILLIS)) framePuts(line, 0, E.statusmsg, msglen, ATTR_PLAIN); // display message for 5 seconds
+}
+
+/**
+ * `abSetAttr()`
+ * appends what it takes to change the terminal's attributes from *pen to attr.
+*/
+void abSetAttr(struct abuf *ab, unsigned char *pen, unsigned char attr) {
+    if (*pen == attr) return;
+    struct sgrseq *seq = ((*pen | attr) & ATTR_INVERSE) ? &sgr[attr] : &sgrcolor[attr];
+    abAppend(ab, seq->s, seq->len);
+    *pen = attr;
+}
+
+/**
+ * `editorScrollShown()`
+ * scrolls the text area of the terminal by delta lines (up if delta > 0), and E.shown along with it,
+ * so that only the lines scrolled into view are left for editorFlushFrame() to send.
+ * The scroll region ("\x1b[top;bottomr", DECSTBM) keeps the status and message bars in place;
+ * "\x1b[nS" and "\x1b[nT" scroll it up and down, and "\x1b[r" resets it.
+*/
+void editorScrollShown(struct abuf *ab, int delta) {
+    int cols = E.framecols;
+    int n = delta > 0 ? delta : -delta;
+    int keep = E.screenrows - n; // lines that stay on screen
+    int y, x;
+
+    char buf[48];
+    int clen = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r", E.screenrows, n, delta > 0 ? 'S' : 'T');
+    abAppend(ab, buf, clen);
+
+    if (delta > 0) {
+        memmove(E.shown, &E.shown[n * cols], sizeof(cell) * keep * cols);
+        y = keep; // new blank lines at the bottom
+    } else {
+        memmove(&E.shown[n * cols], E.shown, sizeof(cell) * keep * cols);
+        y = 0; // new blank lines at the top
+    }
+    for (int end = y + n; y < end; y++) {
+        for (x = 0; x < cols; x++) E.shown[y * cols + x] = (cell){ ' ', ATTR_PLAIN };
+    }
+}
+
+/**
+ * `editorFlushFrame()`
+ * appends to ab what turns the screen the terminal shows (E.shown) into the frame just drawn (E.frame).
+ * Each line is compared cell by cell. A run of changed cells is sent after a cursor move to its start,
+ * runs less than FRAME_GAP_MAX unchanged cells apart are sent as one (that is cheaper than moving the cursor),
+ * and a line that only has blanks left is cut short with "\x1b[K".
+ * A cell holds a byte, not a character: the bytes of a UTF-8 character after the first take up no column on the terminal,
+ * so the cells of a line that has (or had) such a character are not at their columns. That line is sent whole, from column 1.
+ * If the view scrolled by less than a screen, the terminal scrolls the text first (see editorScrollShown()).
+*/
+void abPutCells(struct abuf *ab, unsigned char *pen, cell *cells, int n) { // append the characters of n cells, setting the attributes as they change
+    for (int i = 0; i < n; ) { // a run of cells with the same attributes at a time
+        unsigned char attr = cells[i].attr;
+        int run = i;
+        while (run < n && cells[run].attr == attr) run++;
+
+        abSetAttr(ab, pen, attr);
+        char *p = abExtend(ab, run - i);
+        for (; i < run; i++) *p++ = cells[i].c;
+    }
+}
+
+void editorFlushFrame(struct abuf *ab) {
+    int cols = E.framecols;
+    int cury = -1, curx = -1; // where the terminal's cursor is, if we know
+    unsigned char pen = ATTR_PLAIN; // every flush leaves the attributes reset
+    int y, x, i;
+
+    if (E.shown == NULL) { // the terminal's contents are unknown: clear it and start from blanks
+        abAppend(ab, "\x1b[2J", 4); // clear screen
+        E.shown = malloc(sizeof(cell) * E.framerows * cols);
+        for (i = 0; i < E.framerows * cols; i++) E.shown[i] = (cell){ ' ', ATTR_PLAIN };
+    } else if (E.rowoff != E.shownrowoff && abs(E.rowoff - E.shownrowoff) < E.screenrows) {
+        editorScrollShown(ab, E.rowoff - E.shownrowoff); // what is still on screen just moves
+    }
+    E.shownrowoff = E.rowoff;
+
+    for (y = 0; y < E.framerows; y++) {
+        cell *want = &E.frame[y * cols];
+        cell *have = &E.shown[y * cols];
+        if (memcmp(want, have, sizeof(cell) * cols) == 0) continue; // most lines don't change
+        int end = cols; // past the last cell that isn't blank
+        while (end > 0 && want[end - 1].c == ' ' && want[end - 1].attr == ATTR_PLAIN) end--;
+
+        int whole = 0;
+        for (x = 0; x < cols && !whole; x++) whole = (want[x].c | have[x].c) & 0x80; // part of a UTF-8 character
+        if (whole) {
+            char buf[32];
+            int clen = snprintf(buf, sizeof(buf), "\x1b[%d;1H", y + 1);
+            abAppend(ab, buf, clen);
+            abPutCells(ab, &pen, want, end);
+            if (end < cols) {
+                abSetAttr(ab, &pen, ATTR_PLAIN);
+                abAppend(ab, "\x1b[K", 3);
+            }
+            memcpy(have, want, sizeof(cell) * cols);
+            cury = y;
+            curx = -1; // the column the cursor is at is not the cell's
+            continue;
+        }
+
+        for (x = 0; x < cols; ) {
+            if (want[x].c == have[x].c && want[x].attr == have[x].attr) {
+                x++;
+                continue;
+            }
+
+            int stop = x + 1; // past the last changed cell of the run
+            if (x < end) {
+                for (i = stop; i < end && i - stop < FRAME_GAP_MAX; i++) {
+                    if (want[i].c != have[i].c || want[i].attr != have[i].attr) stop = i + 1;
+                }
+            }
+
+            if (cury != y || curx != x) {
+                char buf[32];
+                int clen = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1); // move the cursor to the run
+                abAppend(ab, buf, clen);
+            }
+            if (x >= end) { // nothing but blanks from here on
+                abSetAttr(ab, &pen, ATTR_PLAIN); // "\x1b[K" fills with the current background
+                abAppend(ab, "\x1b[K", 3); // clear line (K; Erase In Line)
+                stop = cols;
+            } else {
+                abPutCells(ab, &pen, &want[x], stop - x);
+            }
+            memcpy(&have[x], &want[x], sizeof(cell) * (stop - x));
+            cury = y;
+            curx = stop < cols ? stop : -1; // past the last column the cursor waits to wrap: better not count on it
+            x = stop;
+        }
+    }
+    abSetAttr(ab, &pen, ATTR_PLAIN);
 }
 
 /**
@@ -1113,8 +3348,10 @@ void editorDrawMessageBar(struct abuf *ab) {
 */
 void editorRefreshScreen() {
     editorScroll();
+    if (!E.hljob && E.rowoff + E.screenrows - E.hlfrontier <= HL_SYNC_ROWS) editorSyntaxCatchUp(E.rowoff + E.screenrows); // the rows on screen are close: color them now
 
-    struct abuf ab = ABUF_INIT;
+    static struct abuf ab = ABUF_INIT; // kept from frame to frame
+    abReset(&ab);
 
     /**
      * `"\x1b[?25l"`
@@ -1124,12 +3361,14 @@ void editorRefreshScreen() {
      * which isn’t a big deal in this case.
     */
     abAppend(&ab, "\x1b[?25l", 6); // hide cursor(l; Reset Mode)
-    // abAppend(&ab, "\x1b[2J", 4); // clear screen
-    abAppend(&ab, "\x1b[H", 3); // reposition cursor
 
-    editorDrawRows(&ab);
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab);
+    editorFrameResize();
+    editorDrawRows();
+    editorEvictRows(); // free render and hl of rows that scrolled off screen
+    editorDrawStatusBar();
+    editorDrawMessageBar();
+    editorFlushFrame(&ab);
+    editorHighlightStart(); // what is left, the worker thread catches up on
 
     char buf[32];
 
@@ -1145,7 +3384,6 @@ void editorRefreshScreen() {
     abAppend(&ab, "\x1b[?25h", 6); // show cursor(h; Set Mode)
 
     write(STDOUT_FILENO, ab.b, ab.len); // write abuf to stdout
-    abFree(&ab);
 }
 
 /**
@@ -1168,7 +3406,7 @@ void editorSetStatusMessage(const char *fmt, ...) {
     va_start(ap, fmt); // initialize ap to start after fmt
     vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap); // write formatted output to E.statusmsg
     va_end(ap); // clean up the va_list
-    E.statusmsg_time = time(NULL); // set status message time to current time
+    E.statusmsg_time = monotonicMillis(); // set status message time to current time
 }
 
 /*** input ***/
@@ -1182,6 +3420,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 
     while (1) {
         editorSetStatusMessage(prompt, buf);
+        E.statusmsg_time = -1; // the prompt stays up until it is answered
         editorRefreshScreen();
 
         int c = editorReadKey();
@@ -1198,6 +3437,20 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
                 if (callback) callback(buf, c); // call callback function
                 return buf;
             }
+        } else if (c == PASTE_START) { // a paste goes into the prompt up to its first line break
+            size_t len;
+            char *text = editorReadPaste(&len);
+            size_t n = lineEnd(text, text + len) - text;
+            if (buflen + n >= bufsize) {
+                bufsize = buflen + n + 1;
+                buf = realloc(buf, bufsize);
+            }
+            for (size_t i = 0; i < n; i++) {
+                unsigned char ch = text[i];
+                if (!iscntrl(ch) && ch < 128) buf[buflen++] = ch; // what typing would let in
+            }
+            buf[buflen] = '\0'; // null terminate string
+            free(text);
         } else if (!iscntrl(c) && c < 128) { // if c is not a control character and is less than 128
             if (buflen == bufsize - 1) {
                 bufsize *= 2; // double buffer size
@@ -1212,13 +3465,13 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 }
 
 void editorMoveCursor(int key) {
-    erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy]; // get current row (if it exists)
+    erow *row = editorRowAt(E.cy); // get current row (if it exists)
     switch (key) {
         case ARROW_LEFT:
             if (E.cx != 0) E.cx--;
             else if (E.cy > 0) {
                 E.cy--;
-                E.cx = E.row[E.cy].size;
+                E.cx = editorRowAt(E.cy)->size;
             }
             break;
         case ARROW_RIGHT:
@@ -1236,7 +3489,7 @@ void editorMoveCursor(int key) {
             break;
     }
 
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy]; // get current row (if it exists)
+    row = editorRowAt(E.cy); // get current row (if it exists)
     int rowlen = row ? row->size : 0; // get length of current row
     if (E.cx > rowlen) {
         E.cx = rowlen;
@@ -1257,7 +3510,16 @@ void editorProcessKeypress() {
             editorInsertNewLine();
             break;
 
+        case PASTE_START: {
+            size_t len;
+            char *text = editorReadPaste(&len);
+            editorInsertText(text, len);
+            free(text);
+            break;
+        }
+
         case CTRL_KEY('q'): // quit on 'q'
+            editorSaveWait(); // let a background save finish first; it decides whether the buffer is still dirty
             if (E.dirty && quit_times > 0) {
                 editorSetStatusMessage("WARNING!!! File has unsaved changes. Press Ctrl-Q %d more times to quit.", quit_times);
                 quit_times--;
@@ -1277,7 +3539,7 @@ void editorProcessKeypress() {
             break;
 
         case END_KEY:
-            if (E.cy < E.numrows) E.cx = E.row[E.cy].size;
+            if (E.cy < E.numrows) E.cx = editorRowAt(E.cy)->size;
             break;
 
         case CTRL_KEY('f'): // find on 'ctrl-f'
@@ -1343,14 +3605,39 @@ void initEditor() {
     E.rowoff = 0;
     E.coloff = 0;
     E.numrows = 0;
-    E.row = NULL;
+    E.rowroot = rowNodeNew(1); // an empty leaf
+    E.orig = NULL;
+    E.origlen = 0;
+    E.origmaplen = 0;
+    E.origmapped = 0;
+    E.origfd = -1;
+    E.nrendered = 0;
+    E.renderedleaves = NULL;
+    E.hlfrontier = 0;
+    E.hlpending = 0;
+    E.hljob = NULL;
+    E.save = NULL;
+    E.frame = NULL;
+    E.shown = NULL;
+    E.shownrowoff = 0;
+    E.framerows = 0;
+    E.framecols = 0;
+    E.inhead = 0;
+    E.intail = 0;
     E.dirty = 0; // initialize dirty flag to false
     E.filename = NULL;
     E.statusmsg[0] = '\0'; // initialize status message to empty string
     E.statusmsg_time = 0;
     E.syntax = NULL; // initialize syntax highlighting to NULL. There is no filetype for the current file
+    E.syntaxes = NULL;
+    E.nsyntaxes = 0;
+    E.matchrow = -1;
 
+    editorLoadSyntaxes();
+
+    editorInitEvents();
     if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
+    editorInitAttrs();
     E.screenrows -= 2; // make room for status bar and message bar
 }
 
@@ -1363,9 +3650,19 @@ int main(int argc, char *argv[]) {
 
     editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
 
+    /**
+     * Keys that are already waiting are handled before the next frame is drawn,
+     * so a paste or a held-down key costs a frame per 1/FRAME_RATE_MAX seconds instead of a frame per key.
+     * A key typed on its own still gets a frame right away.
+    */
     while (1) {
         editorRefreshScreen();
+        long long frame = monotonicMillis();
         editorProcessKeypress();
+        while (editorInputPending() && monotonicMillis() - frame < 1000 / FRAME_RATE_MAX) {
+            editorScroll(); // what a refresh would have done: page up/down move from E.rowoff
+            editorProcessKeypress();
+        }
     }
     
     return 0;
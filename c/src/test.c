@@ -1,3 +1,237 @@
+/**
+ * Regression tests. main.c is included whole, so the tests can reach into E and the static parts of the editor;
+ * its main() is renamed out of the way. `make test` builds and runs them.
+*/
+#define main tiny_main
+#include "main.c"
+#undef main
+
+int failures = 0;
+char testpath[64]; // a scratch file, see testOpen()
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+void testWrite(const char *text) { // write text to the scratch file, keeping its inode, as another program might
+    int fd = open(testpath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || write(fd, text, strlen(text)) != (ssize_t)strlen(text)) die("testWrite");
+    close(fd);
+}
+
+char *testRead() { // the scratch file's contents, until the next call
+    static char buf[4096];
+    int fd = open(testpath, O_RDONLY);
+    ssize_t n = fd == -1 ? -1 : read(fd, buf, sizeof(buf) - 1);
+    if (n == -1) die("testRead");
+    close(fd);
+    buf[n] = '\0';
+    return buf;
+}
+
+/**
+ * `testOpen()`
+ * starts over with a buffer holding the scratch file, written with text first, as initEditor() and editorOpen() would,
+ * only without a terminal. The rows of the buffer before are dropped, not freed.
+*/
+void testOpen(const char *text) {
+    testWrite(text);
+    editorOrigFree();
+    E.cx = E.cy = E.rx = E.rowoff = E.coloff = 0;
+    E.numrows = 0;
+    E.rowroot = rowNodeNew(1);
+    E.nrendered = 0;
+    E.renderedleaves = NULL;
+    E.hlfrontier = E.hlpending = 0;
+    E.matchrow = -1;
+    editorOpen(testpath);
+}
+
+/**
+ * `testFlushUtf8()`
+ * A line with multi byte UTF-8 characters has more cells than columns on the terminal.
+ * Typing at its end must not send the change to the column of the cell, which is past the end of the text on screen.
+*/
+void testFlushUtf8() {
+    struct abuf ab = ABUF_INIT;
+    const char *text = "h\xc3\xa9llo w\xc3\xb6rld"; // héllo wörld
+
+    E.screenrows = 3;
+    E.screencols = 40;
+    editorFrameResize();
+    for (int y = 0; y < E.framerows; y++) frameLine(y);
+    framePuts(&E.frame[0], 0, text, strlen(text), ATTR_PLAIN);
+    editorFlushFrame(&ab);
+
+    abReset(&ab);
+    framePuts(&E.frame[0], strlen(text), "X", 1, ATTR_PLAIN);
+    editorFlushFrame(&ab);
+    abAppend(&ab, "", 1);
+    CHECK(strstr(ab.b, "\x1b[1;14H") == NULL);
+    CHECK(strstr(ab.b, "\x1b[1;1Hh\xc3\xa9llo w\xc3\xb6rldX") != NULL); // the line again, from its first column
+
+    abReset(&ab);
+    frameLine(0);
+    framePuts(&E.frame[0], 0, "plain", 5, ATTR_PLAIN);
+    editorFlushFrame(&ab);
+    abAppend(&ab, "", 1);
+    CHECK(strstr(ab.b, "\x1b[1;1Hplain\x1b[K") != NULL); // what was on screen had UTF-8 in it too
+    free(ab.b);
+}
+
+/**
+ * `testOrigCheck()`
+ * Another program rewriting the mapped file, keeping its size, within the same second as we opened it,
+ * or cutting it short, must be noticed: the rows take their text from it.
+*/
+void testOrigCheck() {
+    testOpen("aaaa\nbbbb\n");
+    CHECK(E.origmapped);
+    CHECK(editorOrigCheck() == 0);
+    testWrite("cccc\ndddd\n");
+    CHECK(editorOrigCheck() == 1);
+    CHECK(!E.origmapped);
+    CHECK(editorRowAt(0)->owned && editorRowAt(1)->owned);
+    CHECK(E.dirty);
+
+    testOpen("aaaa\nbbbb\n");
+    CHECK(truncate(testpath, 3) == 0);
+    CHECK(editorOrigCheck() == 1);
+    CHECK(editorRowAt(0)->size == 3 && editorRowAt(1)->size == 0); // what is left of them; reading on would raise SIGBUS
+}
+
+/**
+ * `testSaveInPlace()`
+ * An edit that keeps every line where it was is patched into the file,
+ * unless another program changed the file since: that one must not be written over.
+*/
+void testSaveInPlace() {
+    size_t written;
+
+    testOpen("aaaa\nbbbb\n");
+    editorRowInsertChar(editorRowAt(1), 0, 'x');
+    editorRowDelChar(editorRowAt(1), 1);
+    CHECK(editorSaveInPlace(testpath, editorRowsLength(), &written) == 1);
+    CHECK(strcmp(testRead(), "aaaa\nxbbb\n") == 0);
+    CHECK(E.origmapped && editorOrigCheck() == 0); // our own write is not someone else's
+
+    testOpen("aaaa\nbbbb\n");
+    editorRowInsertChar(editorRowAt(1), 0, 'x');
+    editorRowDelChar(editorRowAt(1), 1);
+    testWrite("cccc\ndddd\n");
+    CHECK(editorSaveInPlace(testpath, editorRowsLength(), &written) == 0);
+    CHECK(strcmp(testRead(), "cccc\ndddd\n") == 0);
+    CHECK(!E.origmapped);
+}
+
+/**
+ * `testHighlightPlain()`
+ * Without a syntax with multi line comments no row's state needs finding out: no highlight job copies the file for it,
+ * and an edit doesn't move the frontier back.
+*/
+void testHighlightPlain() {
+    testOpen("one\ntwo\nthree\n");
+    CHECK(E.syntax == NULL);
+    CHECK(E.hlfrontier == E.numrows && E.hlpending == 0);
+    editorHighlightStart();
+    CHECK(E.hljob == NULL);
+
+    E.screenrows = 1; // so the edit is off screen
+    editorDelRow(1);
+    editorInsertRow(2, "four", 4);
+    CHECK(E.hlfrontier == E.numrows && E.hlpending == 0);
+    editorHighlightStart();
+    CHECK(E.hljob == NULL);
+}
+
+/**
+ * `testEvictRowsCheck()`
+ * checks, right after editorEvictRows(), that E.nrendered counts the rows with a render,
+ * and that E.renderedleaves lists exactly the leaves flagged rendered, which take in every leaf such a row is in.
+ * If editorEvictRows() went through the list (swept), only rows on screen are left, and only their leaves are on it.
+ * Otherwise (no more rows than fit on screen are rendered) rows scrolled off, and leaves split, merged or emptied since, may linger.
+*/
+void testEvictRowsCheck(int swept) {
+    int listed = 0, flagged = 0, rendered = 0, at = 0;
+    for (rownode *leaf = E.renderedleaves; leaf; leaf = leaf->rnext) {
+        int n = 0;
+        for (int j = 0; j < leaf->n; j++) n += leaf->rows[j].render != NULL;
+        CHECK(leaf->rendered);
+        CHECK(n > 0 || !swept);
+        listed++;
+    }
+    for (rownode *leaf = rowTreeFirstLeaf(); leaf; leaf = leaf->next) {
+        if (leaf->rendered) flagged++;
+        for (int j = 0; j < leaf->n; j++, at++) {
+            if (!leaf->rows[j].render) continue;
+            CHECK(leaf->rendered);
+            CHECK((at >= E.rowoff && at < E.rowoff + E.screenrows) || !swept);
+            rendered++;
+        }
+    }
+    CHECK(listed == flagged);
+    CHECK(rendered == E.nrendered);
+}
+
+/**
+ * `testEvictRows()`
+ * Scrolling, and splitting and joining lines (which splits and merges leaves) all over a buffer,
+ * must keep the list of rendered leaves that editorEvictRows() walks right.
+*/
+void testEvictRows() {
+    size_t len = 0;
+    char *text = malloc(5000 * 16);
+    for (int i = 0; i < 5000; i++) len += sprintf(&text[len], "line %d\n", i);
+    testOpen(text);
+    free(text);
+
+    E.screenrows = 22;
+    E.screencols = 80;
+    editorFrameResize();
+    srand(1);
+    for (int step = 0; step < 5000 && !failures; step++) {
+        int k = rand() % 5;
+        if (k == 0) E.rowoff = rand() % E.numrows; // jump
+        else if (k == 1) { // scroll a little
+            E.rowoff += rand() % 40 - 20;
+            if (E.rowoff < 0) E.rowoff = 0;
+            if (E.rowoff >= E.numrows) E.rowoff = E.numrows - 1;
+        } else { // split or join lines on screen
+            E.cy = E.rowoff + rand() % E.screenrows;
+            if (E.cy >= E.numrows) E.cy = E.numrows - 1;
+            E.cx = 0;
+            for (int n = rand() % 80; n > 0 && (k == 2 || E.cy > 0); n--) {
+                if (k == 2) editorInsertNewLine();
+                else editorDelChar();
+            }
+        }
+        editorDrawRows();
+        int swept = E.nrendered > E.screenrows;
+        editorEvictRows();
+        testEvictRowsCheck(swept);
+    }
+}
+
 int main() {
+    snprintf(testpath, sizeof(testpath), "/tmp/tiny_test_%d.txt", (int)getpid());
+    E.origfd = -1;
+    E.rowroot = rowNodeNew(1);
+    editorInitAttrs();
+
+    testFlushUtf8();
+    testOrigCheck();
+    testSaveInPlace();
+    testHighlightPlain();
+    testEvictRows();
+
+    unlink(testpath);
+    if (failures) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("all tests passed\n");
     return 0;
 }